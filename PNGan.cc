@@ -1,21 +1,23 @@
-#define VERSION "0.963"
+#define VERSION "0.98"
 
 #define PROG_NAME "PNGan"
 
 /*
 
-This program analyses a PNG file.
+This program analyses PNG files.
+The analysis itself is done by the PNGan library (pngan.h, libpngan.cc),
+this file is the command line program.
 
 Language : C++ (version: C++11)
 
 Compilation :
 - Compiler : (tested with) gcc on linux and cygwin, clang++ on mac
 - Requirements : zlib library and headers must be installed
-- Command : g++ PNGan.cc -lz -o PNGan
+- Command : g++ PNGan.cc libpngan.cc -lz -pthread -o PNGan
 - Alternative commands
-> g++ -Wall --std=c++11 --pedantic-errors PNGan.cc -lz -o PNGan
+> g++ -Wall --std=c++11 --pedantic-errors PNGan.cc libpngan.cc -lz -pthread -o PNGan
   (strict code error checking alternative) 
-> g++ PNGan.cc -O3 -lz -o PNGan
+> g++ PNGan.cc libpngan.cc -O3 -lz -pthread -o PNGan
   (optimised for speed of execution of the binary, a priori not necessary) 
 
 Author : Arnaud Chéritat
@@ -26,293 +28,242 @@ See dev-notes.txt
 
 */
 
-#include "constants.cc"
+#include "pngan.h"
 
 // Libraries
 
-#include <zlib.h>
 #include <iostream>
 #include <fstream>
+#include <memory>
 #include <string>
 #include <vector>
-#include <limits>
-#include <algorithm>
+#include <deque>
+#include <sstream>
 #include <cstring> // bad, used for strcmp and strncmp
-#include <cstdint> // bad, used for int*_t and uint*_t
-
-// Global variables
-
-std::ifstream  ifs;          // input file stream of the PNG image
-unsigned char  signature[10];
-unsigned char  global_flags;
-int32_t        width, height;
-unsigned char  bit_depth, color_type, compression, filter, interlace;
-bool           palette_used, color_used, alpha_used; // color type flags 
-bool           end_chunk_met;
-bool           text_only;
-bool           no_text;
+#include <cstdlib>
+#include <cstdio>
+#include <algorithm>
+#include <chrono>
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#endif
+
+#include "threads.h"
+#include "output.cc"
+#include "scan.cc"
+#include "json.cc"
+#include "index.cc"
+#include "cache.cc"
+#include "tar.cc"
+
+// Options (the same for all the analysed files)
+
+PngOptions     options;
 bool           dump_icc;
-bool           hide_IDAT;
-std::streampos chunk_start, chunk_next;
-std::string    icc_filename;
-std::ofstream  icc_fs;
-long int       palette_size;
-
-int32_t        chunk_length;   // PNG standard tells something strange about the sign here
-char           chunk_name[5];  // null terminated C-style array
-std::vector<char>  chunk_data;
-uint32_t       chunk_crc;
-
-std::streamoff total_idat_chunks;
-std::streamoff total_idat_bytes;
-std::streamoff bad_crc_count;
-std::streamoff total_text_chunks;
-
-long int       error_count;
-
-struct erreur_eof_struct {}  erreur_eof;
-struct erreur_read_struct {} erreur_read;
-struct erreur_neg_struct {}  erreur_neg;
-
-bool first_chunk;      // is current chunk the first one ?
-bool header_met;       // HEADER chunk met ?
-bool palette_met;
-bool data_met;
-bool data_ended;
-bool data_error;
-bool end_met;
-bool background_met;
-bool chroma_met;
-bool gamma_met;
-bool histogram_met;
-bool pixel_met;
-bool transparency_met;
-bool bits_met;
-
-// CRC check (adapted from sample of recommandation document)
-
-uint32_t crc_table[256];
-
-void make_crc_table() {
-  uint32_t c;
-  int n,k;
-  
-  for(n=0; n<256; n++) {
-    c = (uint32_t) n;
-    for(k=0; k<8; k++) {
-      if(c & 1)
-        c = 0xedb88320L ^ (c >> 1);
-      else
-        c = c >> 1;
-    }
-    crc_table[n]=c;
-  }
-}
-
-uint32_t update_crc(uint32_t crc, unsigned char* buf, unsigned int len) {
-  uint32_t c = crc;
-  unsigned int n;
-  
-  for(n=0; n<len; n++) {
-    c = crc_table[(unsigned int)((c ^ buf[n]) & 0xff)] ^ (c >> 8);
-  }
-  return c;
-}
+bool           use_index;     // chunk index sidecar files
+std::unique_ptr<ResultCache> cache; // option --cache
+uint64_t       options_signature;   // key of the cache entries, with the content of the file
+OutputFormat   format = FORMAT_REPORT;
 
 /*
-when fread returns a value < the number of blocks that were called for,
-this can be for two reasons. The function below will determine which and throw the corresponding error.
-*/
+ * Option --timings: the phases of the analyses added up over the files, and
+ * the phase "output" of the program (JSON output and writing of the reports;
+ * a single report is written while analysed, in the phases of the analysis)
+ */
 
-void call_err()
-{
-  if(ifs.eof())
-    throw erreur_eof;
-  else
-    throw erreur_read;
-}
+class Timings {
+  std::mutex m;
+  std::vector<PngPhase> phases; // in the order met
 
-/*
-as the name says... 
-*/
-template<typename T>
-std::string latin1_to_utf8(T &in, size_t len) {
-  std::string out;
-  for(size_t i=0; i<len; i++) {
-    unsigned char ch = in[i];
-    if(ch < 0x80) {
-      out += ch;
-    } else {
-      out += 0xc0 | (ch & 0xc0) >> 6;
-      out += 0x80 | (ch & 0x3f);
+  PngPhase &phase(const std::string &name) {
+    for(PngPhase &p : phases) {
+      if(p.name == name) return p;
     }
+    PngPhase p;
+    p.name = name;
+    p.nanoseconds = p.bytes = p.calls = 0;
+    phases.push_back(p);
+    return phases.back();
   }
-  return out;
-}
 
-/* Reads n bytes from file and puts them in the dynamic array "signature" */
+public:
+  typedef std::chrono::steady_clock Clock;
 
-void readSignature(int n)
-{
-  if(!ifs.read((char*) &signature[0],n)) call_err();
-}
-
-void readChunkName()
-{
-  if(!ifs.read(chunk_name,4)) call_err();
-  chunk_name[4]=0; // null terminated C-style string
-}
+  void add(const std::vector<PngPhase> &file) {
+    std::lock_guard<std::mutex> lk(m);
+    for(const PngPhase &f : file) {
+      PngPhase &p = phase(f.name);
+      p.nanoseconds += f.nanoseconds;
+      p.bytes += f.bytes;
+      p.calls += f.calls;
+    }
+  }
 
-/* Read an (singed or unsigned) integer, reversing bytes order (endianness)
- *
- * This function used to be simpler, by direct memory mapping.
- * I decided to complicate it so as to ensure it works whatever the 
- * encoding of the integer type on the system.
- *
- * n: number of bytes to read
- * _signed: whether to interpret the read bytes as a signed value
- * dest: destination (its type does --not-- need to be an n-bytes type)
- *
- * if sizeof(Int) >= n it will give the correct value
- * if sizeof(Int) < n the behaviour is undefined
- */
-template<typename Int>
-void readNumber(int n, Int& dest, bool _signed)
-{ // endianness is reversed
-  std::vector<unsigned char> tempo(n);
-  if(!ifs.read((char*)tempo.data(),n)) call_err();
-  dest = 0;
-  for(int i=_signed ? 1 : 0; i < n; i++) {
-    dest += ((Int) tempo[i]) << 8*(n-1-i);
+  void addOutput(Clock::time_point start, size_t bytes) {
+    int64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now()-start).count();
+    std::lock_guard<std::mutex> lk(m);
+    PngPhase &p = phase("output");
+    p.nanoseconds += ns;
+    p.bytes += bytes;
+    p.calls++;
   }
-  if(_signed) {
-    unsigned char &c = tempo[0]; // convenience ; hopefully compiler optimizes
-    if(c<128) {
-      dest += ((Int) c) << 8*(n-1);
-    }
-    else { // this is complicated so as avoid an overflow in dest 
-           // (behaviour undefined under C++ standard) 
-      Int temp = 128-(c-128);
-      dest = -((temp << 8*(n-1)) - dest);
+
+  void print() {
+    char line[128];
+    int64_t total = 0;
+    std::cout << "\nTimings:\n";
+    snprintf(line,sizeof(line),"  %-26s %12s %14s %10s %10s\n","phase","seconds","bytes","calls","MB/s");
+    std::cout << line;
+    std::stable_partition(phases.begin(),phases.end(),[](const PngPhase &p) { return p.name != "output"; });
+    for(const PngPhase &p : phases) {
+      snprintf(line,sizeof(line),"  %-26s %12.6f %14lld %10lld",p.name.c_str(),p.nanoseconds/1e9,
+               (long long) p.bytes,(long long) p.calls);
+      std::cout << line;
+      if(p.bytes && p.nanoseconds) {
+        snprintf(line,sizeof(line)," %10.1f",p.bytes*1e3/p.nanoseconds);
+        std::cout << line;
+      }
+      std::cout << "\n";
+      total += p.nanoseconds;
     }
+    snprintf(line,sizeof(line),"  %-26s %12.6f\n","total",total/1e9);
+    std::cout << line;
   }
-}
+};
 
-/* reads content of chunk starting from chunk_start and puts it in chunk_data,
- * reads at most 65535 bytes
- * CAUTION : never call before having called chunkRead
- */
+Timings timings;
 
-bool chunk_stream_finished;
+/*
+ * Analysis of one file
+ * The report is written to out, the errors preventing the analysis to err
+ * (in JSON formats, everything goes to out).
+ * Returns 0 or the code of the fatal error met.
+ */
 
-int32_t chunkReadMorsel() {
-  int32_t len;
-  auto pos = ifs.tellg();
-  if(pos + 65535L >= chunk_start + (std::streamoff)chunk_length) {
-    // the L suffix above is a security, though on most systems it is not necessary
-    chunk_stream_finished=true;
-    len = (int32_t)((chunk_start + (std::streamoff)chunk_length) - pos);
+int openError(const char *filename, const std::string &name, std::ostream &out, std::ostream &err,
+              PngResult &result) {
+  result.fatal_error = OPEN_ERROR;
+  if(format == FORMAT_REPORT) {
+    err << "Fatal Error : unable to open file " << name << "\n";
   }
   else {
-    len = 65535u;
+    JsonVisitor json(out,format == FORMAT_NDJSON,filename);
+    json.on_error("Fatal Error : unable to open file " + name,true);
+    json.finish(result);
   }
-  chunk_data.resize(len);
-  ifs.read(chunk_data.data(),len); // NORMALLY : no eof, as checked in chunkRead()
-  return len;
+  return OPEN_ERROR;
 }
 
-int32_t chunkReadMorselToCout() {
-  int32_t len;
-  auto pos = ifs.tellg();
-  if(pos + 65535L >= chunk_start + (std::streamoff)chunk_length) {
-    // the L suffix above is a security, though on most systems it is not necessary
-    chunk_stream_finished=true;
-    len = (int32_t)((chunk_start + (std::streamoff)chunk_length) - pos);
+// output kept in the cache: in JSON formats, the name of the file is added
+// to each object (the cached output has empty names)
+
+void writeCached(const char *filename, const std::string &text, std::ostream &out) {
+  if(format == FORMAT_REPORT) {
+    out << text;
+    return;
   }
-  else {
-    len = 65535u;
+  static const std::string anonymous = "{\"file\":\"\"";
+  JsonWriter w;
+  w.raw("{").key("file").string(filename,strlen(filename));
+  std::ostringstream named;
+  w.flush(named);
+  size_t start = 0, found;
+  while((found = text.find(anonymous,start)) != std::string::npos) {
+    out.write(text.data()+start,found-start);
+    out << named.str();
+    start = found+anonymous.size();
   }
-  copy_n( std::istreambuf_iterator<char>(ifs),
-          len,
-          std::ostreambuf_iterator<char>(std::cout)
-  );
-  ifs.read(chunk_data.data(),len); // NORMALLY : no eof, as checked in chunkRead()
-  return len;
+  out.write(text.data()+start,text.size()-start);
 }
 
-void chunkStreamInit() {
-  chunk_stream_finished=false;
-}
+int analyseInput(Input &input, const char *filename, bool member, std::ostream &out, std::ostream &err,
+                 PngResult &result);
 
+int analyseFile(const char *filename, std::ostream &out, std::ostream &err, PngResult &result) {
+  result = PngResult();
 
-#include "handlers.cc"
+  // "-": the standard input, read forward only (no memory mapping, no index nor cache)
+  std::unique_ptr<Input> input = strcmp(filename,"-")==0 ? streamInput(std::cin) : openInput(filename);
+  if(!input) {
+    return openError(filename,filename,out,err,result);
+  };
+  return analyseInput(*input,filename,false,out,err,result);
+}
 
+// a file inside an archive (member) has no index nor ICC profile dump
+
+int analyseInput(Input &input, const char *filename, bool member, std::ostream &out, std::ostream &err,
+                 PngResult &result) {
+  // option --cache: a file already analysed with the same options is not analysed again;
+  // the key is a hash of the whole content, read once before the analysis (mapped files
+  // are then analysed from memory), only for the files starting with the PNG signature
+  static const unsigned char png_signature[8] = {137,80,78,71,13,10,26,10};
+  size_t size;
+  const unsigned char *bytes = cache && !(dump_icc && !member) ? input.contents(size) : nullptr;
+  if(bytes && (size < 8 || memcmp(bytes,png_signature,8) != 0)) bytes = nullptr;
+  ResultCache::Key cache_key;
+  if(bytes) {
+    std::string text;
+    cache_key = ResultCache::key(bytes,size,options_signature);
+    if(cache->lookup(cache_key,text,result)) {
+      if(format == FORMAT_REPORT) out << "Analysis of file " << filename << "\n\n";
+      writeCached(filename,text,out);
+      return result.fatal_error;
+    }
+  }
+  std::ostringstream cached;      // the output kept for the cache
+  std::ostream &o = bytes ? cached : out;
 
-// reads next chunk, but without reading the content
-// the file index should be at the beginning of the chunk
+  PngOptions opt = options;
+  std::ofstream icc_fs;
+  if(dump_icc && !member) {
+    std::string icc_filename = std::string(filename)+"-PNGan.icc";
+    icc_fs.open(icc_filename,std::ifstream::binary);
+    if(!icc_fs) {
+      return openError(filename,icc_filename,out,err,result);
+    };
+    icc_fs.exceptions(std::ifstream::failbit | std::ifstream::badbit );
+    opt.icc = &icc_fs;
+  }
 
-void chunkRead() {
-  using std::cout;
-  using std::hex;
-  using std::dec;
+  // option --index: the CRCs found by a previous analysis of the unchanged file
+  FileKey key;
+  std::vector<PngChunk> known;
+  bool indexed = use_index && !member && fileKey(filename,key);
+  if(indexed && IndexFile().load(IndexFile::path(filename),key,known)) {
+    opt.known_chunks = &known;
+  }
 
-  // read name and size
-  
-  readNumber(4,chunk_length,true);
-  readChunkName();
-  bool output=(!text_only) && !(hide_IDAT && strncmp(chunk_name,DATA,4)==0) ;
-  if(output) {
-    cout << "- Chunk " << chunk_name << " (size = " << chunk_length << " bytes)\n";
+  PngVisitor ignore; // the report is enough here
+  PngVisitor *visitor = &ignore;
+  std::unique_ptr<JsonVisitor> json;
+  if(format != FORMAT_REPORT) {
+    // the cached output does not give the name of the file
+    json.reset(new JsonVisitor(o,format == FORMAT_NDJSON,bytes ? "" : filename));
+    visitor = json.get();
   }
-  if(chunk_length < 0) {
-    throw erreur_neg;
+  else {
+    out << "Analysis of file " << filename << "\n\n";
   }
+  IndexVisitor recorder(*visitor);
+  if(indexed) visitor = &recorder;
+
+  result = pngan_analyse(input,*visitor,opt,json ? nullptr : &o);
+  if(options.timings) timings.add(result.phases);
+  Timings::Clock::time_point output_start = Timings::Clock::now();
+  if(json) json->finish(result);
+  if(bytes) {
+    cache->store(cache_key,cached.str(),result);
+    writeCached(filename,cached.str(),out);
+  }
+  if(options.timings && (json || bytes)) timings.addOutput(output_start,0);
 
-  // memorize position in chunk_start
-
-  chunk_start = ifs.tellg();
-
-  // data for the CRC check include the chunk type (but not the chunk length)
-  ifs.seekg(-4,std::ios_base::cur);
-  
-  uint32_t crc = 0xffffffffL;
-  unsigned int len;
-  chunkStreamInit();
-  for( ; !chunk_stream_finished; ) {
-    len = chunkReadMorsel();
-    crc = update_crc(crc,(unsigned char*) chunk_data.data(), len);
-  };
-  crc = crc ^ 0xffffffffL;
-  
-  // CRC (Cyclic Redundancy Check) : value is stored as 4 bytes following the chunk
-  
-  readNumber(4,chunk_crc,false);
-    
-  // memorize next chunk position
-  chunk_next=ifs.tellg();
-
-  if(chunk_crc != crc) {
-    cout << "\n" << "Error: CRC check incorrect (file tells 0x"
-         << hex << chunk_crc << " computation gives 0x" << crc << dec << ")\n\n";
-    bad_crc_count++;
-    error_count++;
-  };
-  
-  // Check if the chunk respects chunk ordering rules
-  
-  checkOrder();
-  
-  // Depending on the chunk name, call appropriate handling function
-
-  ifs.seekg(chunk_start);
-  
-  handleChunk();
-    
-  ifs.seekg(chunk_next);
-
-  // line jump
-  
-  if(output) { cout << "\n"; }
+  // the index is only a cache: if it cannot be written, the next analysis is just slower
+  if(indexed && !result.stopped_early && !sameChunks(known,recorder.chunks)) {
+    IndexFile().save(IndexFile::path(filename),key,recorder.chunks);
+  }
+  return result.fatal_error;
 }
 
 void show_options() { 
@@ -320,8 +271,230 @@ void show_options() {
   std::cout << "            -x (--no-text) : do not output text chunks content\n";
   std::cout << "            -n (--no-idat) : keep silent for image data chunks\n";
   std::cout << "                             total count given at the end\n";
+  std::cout << "            -z (--inflate) : decompress the image data and check its size\n";
+  std::cout << "                             and checksum (the image is not decoded)\n";
+  std::cout << "            -u (--unfilter) : as -z, and rebuild the rows to check their\n";
+  std::cout << "                              filter types\n";
+  std::cout << "            -p (--profile) : as -u, and show the zlib header and how well\n";
+  std::cout << "                             each band of rows compresses\n";
+  std::cout << "            -H (--header-only[=FIELDS]) : stop at the first image data chunk,\n";
+  std::cout << "                             or once the chunks wanted are found; FIELDS among\n";
+  std::cout << "                             IHDR,iCCP,sRGB,gAMA (default: all of them), the\n";
+  std::cout << "                             other chunks are skipped\n";
+  std::cout << "            --crc=full|metadata|N% : CRC checked on all the chunks (default),\n";
+  std::cout << "                             on all but the image data chunks (not read then\n";
+  std::cout << "                             unless decompressed), or on N% of them\n";
+  std::cout << "            --index : keep the chunks found in filename-PNGan.idx; if the\n";
+  std::cout << "                      file has not changed, the next analyses do not\n";
+  std::cout << "                      compute the CRCs again nor read the image data\n";
+  std::cout << "            --cache=DIR : keep the results in the directory DIR; a file with\n";
+  std::cout << "                          the same content analysed again with the same\n";
+  std::cout << "                          options is not analysed (not with -icc); the\n";
+  std::cout << "                          files without the PNG signature are not kept\n";
+  std::cout << "            --cache-size=MB : bound of the cache size (default: 256 MB)\n";
+  std::cout << "            --timings : time and bytes of each phase of the analysis (I/O,\n";
+  std::cout << "                        CRC, decompression, each chunk handler...), added\n";
+  std::cout << "                        up at the end, or given for each file in JSON\n";
+  std::cout << "            --tar : the files given are tar archives (- for the standard\n";
+  std::cout << "                    input), the PNG files inside are analysed in place\n";
   std::cout << "            -icc : dump ICC profile to filename-PNGan.icc\n";
   std::cout << "                   (possibly overwriting this .icc file)\n";
+  std::cout << "            -r (--recursive) : analyse the PNG files found in the directories\n";
+  std::cout << "                               given (and their sub-directories)\n";
+  std::cout << "            -l (--list) : read the names of the files to analyse on the\n";
+  std::cout << "                          standard input, one per line\n";
+  std::cout << "            -j N (--jobs=N) : number of threads (default: number of processors)\n";
+  std::cout << "                              several files are analysed at the same time\n";
+  std::cout << "            --json : one JSON object per file instead of the report\n";
+  std::cout << "            --ndjson : one JSON object per line for each chunk, text and error\n";
+  std::cout << "            --crc-engine=NAME : CRC computation engine, among\n";
+  std::cout << "                   table, slice8, slice16, clmul (default: fastest available)\n";
+  std::cout << "            --filter-engine=NAME : row filters engine (option -u), among\n";
+  std::cout << "                   scalar, sse2, avx2, neon (default: fastest available)\n";
+}
+
+/*
+ * Analysis of several files on the thread pool
+ * The reports are written in the order the files come out of the queue, each
+ * one as soon as it and the previous ones are finished. At most "window" files
+ * are in progress or waiting to be written.
+ * The files found in directories that are not PNG files are skipped silently.
+ * Returns the bitwise or of the fatal error codes.
+ */
+
+struct Report {
+  std::string text;
+  int code;
+  long int error_count;
+  bool skipped;
+  bool done;
+  Report() : code(0), error_count(0), skipped(false), done(false) {}
+};
+
+struct BatchCounts {
+  long int analysed, with_errors, fatal;
+  BatchCounts() : analysed(0), with_errors(0), fatal(0) {}
+};
+
+int analyseBatch(FileQueue &queue, BatchCounts &counts) {
+  ThreadPool &p = getPool();
+  const size_t window = 16*p.size();
+  std::deque<std::unique_ptr<Report>> reports; // reports not written yet, in order
+  std::mutex done_m;
+  std::condition_variable done_cv;
+  ThreadPool::Group group;
+  bool queue_finished = false;
+  int code = 0;
+
+  for(;;) {
+    FileEntry entry;
+    while(!queue_finished && reports.size() < window) {
+      if(!queue.pop(entry,p)) {
+        queue_finished = true;
+        break;
+      }
+      Report *r = new Report;
+      reports.emplace_back(r);
+      std::string filename = entry.name;
+      bool found = entry.found;
+      p.submit(group,[r,filename,found,&done_m,&done_cv]() {
+        ThreadReport os;
+        PngResult result;
+        int c = analyseFile(filename.c_str(),*os,*os,result);
+        std::lock_guard<std::mutex> lk(done_m);
+        r->skipped = found && !result.signature_ok;
+        if(!r->skipped) r->text.assign(os->data(),os->size());
+        r->code = c;
+        r->error_count = result.error_count;
+        r->done = true;
+        done_cv.notify_all();
+      });
+    }
+    if(reports.empty()) break;
+
+    Report &r = *reports.front();
+    for(;;) {
+      {
+        std::lock_guard<std::mutex> lk(done_m);
+        if(r.done) break;
+      }
+      if(!p.runOne()) {
+        std::unique_lock<std::mutex> lk(done_m);
+        done_cv.wait(lk,[&r]{ return r.done; });
+      }
+    }
+    if(!r.skipped) {
+      Timings::Clock::time_point output_start = Timings::Clock::now();
+      if(counts.analysed && format == FORMAT_REPORT) writeOut("\n",1);
+      writeOut(r.text.data(),r.text.size());
+      if(options.timings) timings.addOutput(output_start,r.text.size());
+      counts.analysed++;
+      code |= r.code;
+      if(r.code) counts.fatal++;
+      else if(r.error_count) counts.with_errors++;
+    }
+    reports.pop_front();
+  }
+  p.wait(group);
+  p.wait(queue.group);
+  if(queue.errors) code |= OPEN_ERROR;
+  return code;
+}
+
+/*
+ * Analysis of the PNG files inside a tar archive (option --tar), one after
+ * the other in the order of the archive
+ * Returns the bitwise or of the fatal error codes.
+ */
+
+int analyseTar(const char *filename, BatchCounts &counts) {
+  std::unique_ptr<Input> input = strcmp(filename,"-")==0 ? streamInput(std::cin) : openInput(filename);
+  if(!input) {
+    PngResult result;
+    std::cout << (counts.analysed && format == FORMAT_REPORT ? "\n" : "");
+    openError(filename,filename,std::cout,std::cerr,result);
+    return OPEN_ERROR;
+  }
+  TarReader tar(*input);
+  std::string name;
+  uint64_t size;
+  int code = 0;
+  while(tar.next(name,size)) {
+    std::streamoff end = input->pos+size;
+    std::string member = std::string(filename)+":"+name;
+    ThreadReport os;
+    PngResult result;
+    {
+      std::unique_ptr<Input> view = boundedInput(*input,size);
+      analyseInput(*view,member.c_str(),true,*os,*os,result);
+    }
+    if(result.signature_ok) { // the other files are skipped
+      Timings::Clock::time_point output_start = Timings::Clock::now();
+      if(counts.analysed && format == FORMAT_REPORT) writeOut("\n",1);
+      size_t size = os->size();
+      os->writeOut();
+      if(options.timings) timings.addOutput(output_start,size);
+      counts.analysed++;
+      code |= result.fatal_error;
+      if(result.fatal_error) counts.fatal++;
+      else if(result.error_count) counts.with_errors++;
+    }
+    if(!tar.skipTo(end)) break;
+  }
+  if(!tar.error.empty()) {
+    std::cout.flush();
+    std::cerr << "Fatal Error : " << filename << ": " << tar.error << "\n";
+    code |= FILE_ERROR;
+  }
+  std::cout.flush();
+  return code;
+}
+
+void printSummary(const BatchCounts &counts) {
+  using std::cout;
+  cout << "\n" << counts.analysed << " files analysed: "
+       << counts.analysed-counts.with_errors-counts.fatal << " OK, "
+       << counts.with_errors << " with non-fatal errors, "
+       << counts.fatal << " with fatal errors\n";
+  if(cache) {
+    cout << "Cache: " << cache->run_hits << " hits, " << cache->run_misses << " misses ("
+         << cache->hits() << " hits, " << cache->misses() << " misses in all, "
+         << cache->entries() << " entries, " << cache->bytes() << " bytes)\n";
+  }
+}
+
+/*
+ * Fields of option --header-only: comma separated chunk names,
+ * returns 0 if one is unknown
+ */
+
+unsigned parseFields(const char *list) {
+  static const char *names[] = {HEADER, EMBEDDED_ICC, SRGB, GAMMA}; // in the order of the FIELD_* bits
+  unsigned fields = 0;
+  while(*list) {
+    size_t len = strcspn(list,",");
+    int i;
+    for(i=0; i<4; i++) {
+      if(len == 4 && strncmp(list,names[i],4) == 0) break;
+    }
+    if(i == 4) return 0;
+    fields |= 1u << i;
+    list += len;
+    if(*list == ',') list++;
+  }
+  return fields;
+}
+
+/*
+ * Percentage of option --crc: "N%" with N from 0 to 100
+ */
+
+bool parsePercent(const char *s, int &percent) {
+  char *end;
+  long n = strtol(s,&end,10);
+  if(end == s || strcmp(end,"%") != 0 || n < 0 || n > 100) return false;
+  percent = (int) n;
+  return true;
 }
 
 /*
@@ -332,15 +505,15 @@ int main(int argc, char * argv[]) {
 
   using std::cout;
 
-  cout << "PngAn v" << VERSION << "\n\n";
-  
-  make_crc_table();
-  
+  // the reports are written in blocks (output.cc), without the C stdio
+  std::ios_base::sync_with_stdio(false);
+
   // test number of aguments
 
   if(argc<2) {
-    cout << "Usage : " << PROG_NAME << " [options] filename\n";
-    cout << "  filename : name of the PNG file to be analysed\n";
+    cout << "PngAn v" << VERSION << "\n\n";
+    cout << "Usage : " << PROG_NAME << " [options] filename [filename...]\n";
+    cout << "  filename : name of the PNG file to be analysed, - for the standard input\n";
     show_options();
     cout << "A simple PNG file Analyser\n";
     cout << "(PNG version up to 1.2, no decoding of image data)\n";
@@ -349,166 +522,188 @@ int main(int argc, char * argv[]) {
     exit(0);
   };
 
-  text_only = false;
-  hide_IDAT = false;
-  no_text = false;
-  for(int i=1; i<argc-1; i++) {
+  bool list = false;
+  bool recursive = false;
+  bool tar = false;
+  const char *cache_dir = nullptr;
+  uint64_t cache_size = 256;
+  const char *crc_engine_arg = nullptr;
+  const char *filter_engine_arg = nullptr;
+  int i;
+  for(i=1; i<argc && argv[i][0]=='-' && argv[i][1]!=0; i++) {
     if(strcmp(argv[i],"-t")==0 || strcmp(argv[i],"--text-only")==0) {
-      text_only = true;
+      options.text_only = true;
     }
     else if(strcmp(argv[i],"-n")==0 || strcmp(argv[i],"--no-idat")==0) {
-      hide_IDAT = true;
+      options.hide_IDAT = true;
+    }
+    else if(strcmp(argv[i],"-z")==0 || strcmp(argv[i],"--inflate")==0) {
+      options.inflate = true;
+    }
+    else if(strcmp(argv[i],"-u")==0 || strcmp(argv[i],"--unfilter")==0) {
+      options.inflate = true;
+      options.unfilter = true;
+    }
+    else if(strcmp(argv[i],"-p")==0 || strcmp(argv[i],"--profile")==0) {
+      options.inflate = true;
+      options.unfilter = true;
+      options.profile = true;
+    }
+    else if(strcmp(argv[i],"-H")==0 || strcmp(argv[i],"--header-only")==0) {
+      options.header_only = FIELDS_ALL;
+    }
+    else if(strncmp(argv[i],"--header-only=",14)==0 && parseFields(argv[i]+14)) {
+      options.header_only = parseFields(argv[i]+14);
     }
     else if(strcmp(argv[i],"-x")==0 || strcmp(argv[i],"--no-text")==0) {
-      no_text = true;
+      options.no_text = true;
     }
     else if(strcmp(argv[i],"-icc")==0) {
       dump_icc = true;
     }
-    else {
-      cout << "Error : bad option " << argv[i] << " (option=all but last argument, filename comes last)\n";
-      show_options();
-      exit(ARG_ERROR);
+    else if(strcmp(argv[i],"-r")==0 || strcmp(argv[i],"--recursive")==0) {
+      recursive = true;
     }
-  }
-  
-  // open the file
-
-  char *filename=argv[argc-1]; // PNG filename
-                               // argv so no need to free this pointer
-  ifs.open(filename,std::ifstream::binary);
-  if(!ifs) {
-    std::cerr << "Fatal Error : unable to open file " << filename << "\n";
-    exit(OPEN_ERROR);
-  };
-
-  if(dump_icc) {
-    icc_filename = std::string(filename)+"-PNGan.icc";
-    icc_fs.open(icc_filename,std::ifstream::binary);
-    icc_fs.exceptions(std::ifstream::failbit | std::ifstream::badbit );
-    if(!icc_fs) {
-      std::cerr << "Fatal Error : unable to open file " << icc_filename << "\n";
-      exit(OPEN_ERROR);
-    };
-  }
-
-  cout << "Analysis of file " << filename << "\n\n";
-  
-  // start the analysis
-
-  total_idat_chunks = 0;
-  total_idat_bytes = 0;
-  bad_crc_count = 0;
-
-  bool output=!text_only;
-
-  try {
-    
-    // Read signature
-    
-    const int sig_size=8; // 8
-    unsigned char sig[sig_size] = {137,80,78,71,13,10,26,10};
-
-    readSignature(sig_size);
-    
-    if(output) { cout << "- Signature (first 8 bytes) :"; }
-    
-    if(output) {
-      for(int i=0; i<sig_size; i++) {
-        cout  << " " << (int) signature[i];
-      }
-      cout << "\n"; 
-    } 
-    if(strncmp((char *) signature,(char *) sig, sig_size)==0) {
-      if(output) { cout << "  correct" << "\n\n"; }
+    else if(strcmp(argv[i],"-l")==0 || strcmp(argv[i],"--list")==0) {
+      list = true;
     }
-    else {
-      cout << "\n" << "Fatal Error: wrong signature\n" 
-           << "(should be = h89 h50 h4E h47 h0D h0A h1A h0A in hex,\n" 
-           << "meaning 137 80 78 71 13 10 26 10 in decimal)\n";
-      exit(SIGN_ERROR);
-    };
-    
-    // initialise order flags
-    
-    first_chunk=true;
-    header_met=false;
-    palette_met=false;
-    data_met=false;
-    data_ended=false;
-    data_error=false;
-    end_met=false;
-    background_met=false;
-    gamma_met=false;
-    chroma_met=false;
-    histogram_met=false;
-    pixel_met=false;
-    transparency_met=false;
-    bits_met=false;
-
-    // main loop
-    
-    end_chunk_met=false;
-    bool file_end=false;
-    do {
-      chunkRead(); // handle next chunk
-      file_end = ifs.peek() == EOF; // ifs.eof();
-    } while(!end_chunk_met && !file_end);
-
-    if(!end_chunk_met) {
-      cout << "Error: no END chunk\n";
-      error_count++;
+    else if(strcmp(argv[i],"-j")==0 && i+1<argc) {
+      pngan_set_jobs(atoi(argv[++i]));
     }
-    else {
-      if(!file_end) {
-        std::streampos pos = ifs.tellg();
-        ifs.seekg(0,std::ios_base::end);
-        std::streampos end = ifs.tellg();
-        cout << "Error: data beyond chunk END (" << (end-pos) << " bytes)\n";
-        error_count++;
-      }
+    else if(strncmp(argv[i],"--jobs=",7)==0) {
+      pngan_set_jobs(atoi(argv[i]+7));
     }
-    
-    if(!text_only) {
-      if(hide_IDAT) cout << "- ";
-      cout << "Image data: " << total_idat_bytes << " bytes in " << total_idat_chunks << " IDAT chunks\n\n"; 
+    else if(strcmp(argv[i],"--tar")==0) {
+      tar = true;
     }
-
-    if(text_only && total_text_chunks==0) {
-      cout << "Found no text chunk\n\n";
+    else if(strcmp(argv[i],"--timings")==0) {
+      options.timings = true;
+    }
+    else if(strcmp(argv[i],"--index")==0) {
+      use_index = true;
+    }
+    else if(strncmp(argv[i],"--cache=",8)==0) {
+      cache_dir = argv[i]+8;
+    }
+    else if(strncmp(argv[i],"--cache-size=",13)==0) {
+      cache_size = strtoull(argv[i]+13,nullptr,10);
+    }
+    else if(strcmp(argv[i],"--json")==0) {
+      format = FORMAT_JSON;
+    }
+    else if(strcmp(argv[i],"--ndjson")==0) {
+      format = FORMAT_NDJSON;
+    }
+    else if(strcmp(argv[i],"--crc=full")==0) {
+      options.crc_policy = CRC_FULL;
+    }
+    else if(strcmp(argv[i],"--crc=metadata")==0) {
+      options.crc_policy = CRC_METADATA;
+    }
+    else if(strncmp(argv[i],"--crc=",6)==0 && parsePercent(argv[i]+6,options.crc_sample)) {
+      options.crc_policy = CRC_SAMPLED;
+    }
+    else if(strncmp(argv[i],"--crc-engine=",13)==0) {
+      crc_engine_arg = argv[i]+13;
     }
+    else if(strncmp(argv[i],"--filter-engine=",16)==0) {
+      filter_engine_arg = argv[i]+16;
+    }
+    else {
+      cout << "PngAn v" << VERSION << "\n\n";
+      cout << "Error : bad option " << argv[i] << " (options come first, then the filenames)\n";
+      show_options();
+      exit(ARG_ERROR);
+    }
+  }
 
-    if(bad_crc_count) cout << "Found " << bad_crc_count << " chunks with bad crc checksum\n\n"; 
+  // the JSON formats are only JSON
+  if(format == FORMAT_REPORT) {
+    cout << "PngAn v" << VERSION << "\n\n";
+  }
 
-    cout << "Analysis finished.\n\n";
-    
-    if(error_count >0) {
-      cout << error_count << " non-fatal error" << (error_count>1 ? "s" : "") << " detected.\n";
-    } else {
-      cout << "File looks OK.\n";
+  std::vector<std::string> files(argv+i,argv+argc);
+  if(list) {
+    std::string line;
+    while(std::getline(std::cin,line)) {
+      if(!line.empty() && line.back()=='\r') line.pop_back();
+      if(!line.empty()) files.push_back(line);
     }
-    cout << "(No image decoding attempted.)\n";
   }
-  catch(erreur_eof_struct err) {
-    cout << "Fatal Error: unexpected end of file\n";
-    exit(EOF_ERROR);
+  if(files.empty()) {
+    cout << "Error : no file to analyse\n";
+    exit(ARG_ERROR);
   }
-  catch(erreur_read_struct err) {
-    cout << "Fatal Error: file read error\n";
-    exit(READ_ERROR);
+  if(std::count(files.begin(),files.end(),"-") > (list ? 0 : 1)) {
+    cout << "Error : the standard input (-) can only be analysed once, and not with -l\n";
+    exit(ARG_ERROR);
   }
-  catch(std::bad_alloc &err) {
-    std::cerr << "Fatal Error : memory error\n";
-    exit(MEM_ERROR);
+#ifdef _WIN32
+  _setmode(_fileno(stdin),_O_BINARY);
+#endif
+  
+  if(!pngan_init(crc_engine_arg,filter_engine_arg)) {
+    cout << "Error : ";
+    if(crc_engine_arg) cout << "CRC engine " << crc_engine_arg << (filter_engine_arg ? " or " : "");
+    if(filter_engine_arg) cout << "filter engine " << filter_engine_arg;
+    cout << " not available on this system\n";
+    exit(ARG_ERROR);
   }
-  catch(erreur_neg_struct err) {
-    cout << "Fatal Error: negative length chunk\n";
-    exit(NEG_ERROR);
+
+  if(cache_dir) {
+    cache.reset(new ResultCache);
+    if(!cache->open(cache_dir,cache_size << 20)) {
+      cout << "Error : cannot use the cache directory " << cache_dir << "\n";
+      exit(ARG_ERROR);
+    }
+    // everything that changes the output
+    std::ostringstream sig;
+    sig << VERSION << " " << format << " " << options.text_only << options.no_text << options.hide_IDAT
+        << options.inflate << options.unfilter << options.profile << " " << options.header_only
+        << " " << options.crc_policy << " " << options.crc_sample << " " << use_index << options.timings;
+    std::string s = sig.str();
+    options_signature = xxh::xxh64((const unsigned char *) s.data(),s.size());
+  }
+
+  if(tar) {
+    BatchCounts counts;
+    int code = 0;
+    for(auto &name : files) code |= analyseTar(name.c_str(),counts);
+    if(format == FORMAT_REPORT) printSummary(counts);
+    if(format == FORMAT_REPORT && options.timings) timings.print();
+    return code;
+  }
+
+  if(files.size()==1 && !(recursive && isDirectory(files[0]))) {
+    PngResult result;
+    ThreadReport report(true); // written out as it grows
+    int code = analyseFile(files[0].c_str(),*report,std::cerr,result);
+    report->writeOut();
+    if(format == FORMAT_REPORT && options.timings) timings.print();
+    return code;
   }
-  catch (std::ifstream::failure &e) {
-    std::cerr << "Fatal Error : exception opening/reading/closing file\n";
-    exit(FILE_ERROR);
+
+  // the directories are read while the files are analysed
+
+  FileQueue queue;
+  for(auto &name : files) {
+    if(recursive && isDirectory(name)) {
+      queue.addProducer();
+      ThreadPool &p = getPool();
+      p.submit(queue.group,[name,&queue,&p]() {
+        scanDirectory(name,queue,p);
+        queue.removeProducer();
+      });
+    }
+    else {
+      queue.push(name,false);
+    }
   }
+  queue.removeProducer();
 
-  // file automatically closed
+  BatchCounts counts;
+  int code = analyseBatch(queue,counts);
+  if(format == FORMAT_REPORT) printSummary(counts);
+  if(format == FORMAT_REPORT && options.timings) timings.print();
+  return code;
 }
@@ -0,0 +1,335 @@
+/*
+
+Benchmark of the PNGan library
+
+Generates a corpus of synthetic PNG files, each one stressing one part of
+the analysis, then measures the time of each stage on each file:
+  chunks   : chunks, CRCs and content of the known chunks (default options)
+  inflate  : decompression of the image data (option -z)
+  unfilter : rebuilding of the rows (option -u)
+with the file already in memory (warm) and read from the disk after its
+pages were dropped from the cache (cold, posix_fadvise, best effort).
+A stage cannot run alone: the analysis is timed with the options of each
+stage added to those of the previous ones, and the time of a stage is the
+difference with the previous one ("-" when the difference is lost in the
+noise of the measure). The last column gives the whole analysis.
+The corpus is generated from fixed seeds: the numbers of two builds can be
+compared.
+
+Compilation :
+> g++ -std=c++11 -O2 bench.cc libpngan.cc -lz -pthread -o bench
+
+Usage : bench [-n RUNS] [-d DIR] [--keep]
+  -n RUNS : runs of each measure, the median is given (default 5)
+  -d DIR  : where the corpus is written for the cold runs (default: bench-corpus)
+  --keep  : keep the corpus after the runs
+
+*/
+
+#include "pngan.h"
+
+#include <zlib.h>
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#ifndef _WIN32
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// Synthetic PNG files
+
+class PngBuilder {
+  uint32_t seed;
+
+  void put32(uint32_t v) {
+    for(int i=3; i>=0; i--) data += (char)(v >> (8*i));
+  }
+
+public:
+  std::string data;
+  long chunks;
+
+  explicit PngBuilder(uint32_t s) : seed(s), chunks(0) {
+    data.assign("\x89PNG\r\n\x1a\n",8);
+  }
+
+  // deterministic pseudo-random numbers
+  uint32_t random() {
+    seed = seed*1664525u + 1013904223u;
+    return seed >> 8;
+  }
+
+  void chunk(const char *type, const std::string &content, bool bad_crc = false) {
+    put32((uint32_t) content.size());
+    size_t start = data.size();
+    data.append(type,4);
+    data += content;
+    uLong crc = crc32(0L,(const Bytef *) data.data()+start,(uInt)(content.size()+4));
+    put32((uint32_t) crc ^ (bad_crc ? 1 : 0));
+    chunks++;
+  }
+
+  void header(uint32_t width, uint32_t height, int bit_depth, int color_type, int interlace) {
+    std::string h;
+    for(int i=3; i>=0; i--) h += (char)(width >> (8*i));
+    for(int i=3; i>=0; i--) h += (char)(height >> (8*i));
+    h += (char) bit_depth;
+    h += (char) color_type;
+    h += '\0';
+    h += '\0';
+    h += (char) interlace;
+    chunk("IHDR",h);
+  }
+
+  // rows of "bytes" bytes, with the filter types in turn and a smooth
+  // noisy content (any content is valid for every filter type)
+  std::string rows(uint32_t count, size_t bytes) {
+    std::string raw;
+    raw.reserve(count*(bytes+1));
+    for(uint32_t y=0; y<count; y++) {
+      raw += (char)(y % 5);
+      for(size_t x=0; x<bytes; x++) raw += (char)((x+y)/4 + (random() & 7));
+    }
+    return raw;
+  }
+
+  // raw image data of an 8 bits RGBA image, interlaced or not
+  std::string imageData(uint32_t width, uint32_t height, bool interlaced) {
+    if(!interlaced) return rows(height,(size_t)width*4);
+    static const int x0[] = {0,4,0,2,0,1,0}, y0[] = {0,0,4,0,2,0,1};
+    static const int dx[] = {8,8,4,4,2,2,1}, dy[] = {8,8,8,4,4,2,2};
+    std::string raw;
+    for(int p=0; p<7; p++) {
+      uint32_t w = (width+dx[p]-1-x0[p])/dx[p], h = (height+dy[p]-1-y0[p])/dy[p];
+      if(width <= (uint32_t)x0[p]) w = 0;
+      if(height <= (uint32_t)y0[p]) h = 0;
+      if(w && h) raw += rows(h,(size_t)w*4);
+    }
+    return raw;
+  }
+
+  static std::string compress(const std::string &raw, int level = 6) {
+    uLongf size = compressBound((uLong) raw.size());
+    std::string out(size,'\0');
+    compress2((Bytef *) &out[0],&size,(const Bytef *) raw.data(),(uLong) raw.size(),level);
+    out.resize(size);
+    return out;
+  }
+
+  // the zlib stream in IDAT chunks of at most "size" bytes, one CRC out of "bad" wrong (0: none)
+  void imageChunks(const std::string &z, size_t size, long bad = 0) {
+    long n = 0;
+    for(size_t p=0; p<z.size(); p+=size) {
+      n++;
+      chunk("IDAT",z.substr(p,size),bad && n % bad == 0);
+    }
+  }
+
+  void end() { chunk("IEND",""); }
+};
+
+struct Case {
+  std::string name;
+  std::string data;
+  long chunks;
+};
+
+std::vector<Case> corpus() {
+  std::vector<Case> cases;
+  auto add = [&cases](const char *name, PngBuilder &b) {
+    b.end();
+    Case c;
+    c.name = name;
+    c.data = b.data;
+    c.chunks = b.chunks;
+    cases.push_back(c);
+  };
+
+  { // many tiny IDAT chunks
+    PngBuilder b(1);
+    b.header(1024,1024,8,6,0);
+    b.imageChunks(PngBuilder::compress(b.imageData(1024,1024,false)),64);
+    add("tiny-idats",b);
+  }
+  { // one huge IDAT chunk
+    PngBuilder b(2);
+    b.header(4096,4096,8,6,0);
+    b.imageChunks(PngBuilder::compress(b.imageData(4096,4096,false)),1u << 30);
+    add("huge-idat",b);
+  }
+  { // many text chunks, of the three kinds
+    PngBuilder b(3);
+    b.header(64,64,8,6,0);
+    for(int i=0; i<3000; i++) {
+      std::string text;
+      for(int k=0; k<200; k++) text += (char)('a' + b.random() % 26);
+      b.chunk("tEXt",std::string("Comment",8)+text);
+      b.chunk("zTXt",std::string("Comment\0\0",9)+PngBuilder::compress(text));
+      b.chunk("iTXt",std::string("Comment\0\0\0en\0Commentaire\0",25)+text);
+    }
+    b.imageChunks(PngBuilder::compress(b.imageData(64,64,false)),8192);
+    add("text-chunks",b);
+  }
+  { // large ICC profile
+    PngBuilder b(4);
+    b.header(64,64,8,6,0);
+    std::string profile;
+    for(int i=0; i<(4 << 20); i++) profile += (char)(i/64 + (b.random() & 3));
+    b.chunk("iCCP",std::string("Profile\0\0",9)+PngBuilder::compress(profile));
+    b.imageChunks(PngBuilder::compress(b.imageData(64,64,false)),8192);
+    add("large-iccp",b);
+  }
+  { // Adam7
+    PngBuilder b(5);
+    b.header(2048,2048,8,6,1);
+    b.imageChunks(PngBuilder::compress(b.imageData(2048,2048,true)),65536);
+    add("interlaced",b);
+  }
+  { // the same image, not interlaced
+    PngBuilder b(5);
+    b.header(2048,2048,8,6,0);
+    b.imageChunks(PngBuilder::compress(b.imageData(2048,2048,false)),65536);
+    add("progressive",b);
+  }
+  { // one CRC out of ten wrong
+    PngBuilder b(6);
+    b.header(1024,1024,8,6,0);
+    b.imageChunks(PngBuilder::compress(b.imageData(1024,1024,false)),4096,10);
+    add("corrupt-crc",b);
+  }
+  return cases;
+}
+
+// Measures
+
+struct Stage {
+  const char *name;
+  bool inflate, unfilter;
+};
+
+const Stage stages[] = {
+  { "chunks",   false, false },
+  { "inflate",  true,  false },
+  { "unfilter", true,  true  },
+};
+
+typedef std::chrono::steady_clock Clock;
+
+double median(std::vector<double> v) {
+  std::sort(v.begin(),v.end());
+  return v[v.size()/2];
+}
+
+// the pages of the file are dropped from the cache (best effort)
+bool dropCache(const std::string &path) {
+#if !defined(_WIN32) && defined(POSIX_FADV_DONTNEED)
+  int fd = open(path.c_str(),O_RDONLY);
+  if(fd < 0) return false;
+  fdatasync(fd);
+  bool ok = posix_fadvise(fd,0,0,POSIX_FADV_DONTNEED) == 0;
+  close(fd);
+  return ok;
+#else
+  return false;
+#endif
+}
+
+// throughput of a stage in the column of a table, "-" if its time is not known
+std::string rate(double amount, double seconds, int width, int precision) {
+  char text[32];
+  if(seconds > 0) snprintf(text,sizeof(text),"%*.*f",width,precision,amount/seconds);
+  else snprintf(text,sizeof(text),"%*s",width,"-");
+  return text;
+}
+
+// seconds taken by the analysis, from memory or from the file
+double analyse(const Case &c, const std::string &path, const PngOptions &options, bool cold) {
+  PngVisitor ignore;
+  Clock::time_point start = Clock::now();
+  if(cold) {
+    std::unique_ptr<Input> in = openInput(path.c_str());
+    if(in) pngan_analyse(*in,ignore,options);
+  }
+  else {
+    std::unique_ptr<Input> in = memoryInput((const unsigned char *) c.data.data(),c.data.size());
+    pngan_analyse(*in,ignore,options);
+  }
+  return std::chrono::duration<double>(Clock::now()-start).count();
+}
+
+int main(int argc, char *argv[]) {
+  int runs = 5;
+  std::string dir = "bench-corpus";
+  bool keep = false;
+  for(int i=1; i<argc; i++) {
+    if(strcmp(argv[i],"-n")==0 && i+1<argc) runs = std::max(1,atoi(argv[++i]));
+    else if(strcmp(argv[i],"-d")==0 && i+1<argc) dir = argv[++i];
+    else if(strcmp(argv[i],"--keep")==0) keep = true;
+    else {
+      std::cout << "Usage : bench [-n RUNS] [-d DIR] [--keep]\n";
+      return 1;
+    }
+  }
+
+  pngan_init();
+  std::vector<Case> cases = corpus();
+
+#ifndef _WIN32
+  mkdir(dir.c_str(),0777);
+#endif
+  bool cold_ok = true;
+  for(const Case &c : cases) {
+    std::ofstream f(dir+"/"+c.name+".png",std::ofstream::binary);
+    f.write(c.data.data(),c.data.size());
+    if(!f) cold_ok = false;
+  }
+
+  char line[160];
+  snprintf(line,sizeof(line),"%-12s %10s %8s  %-8s %10s %12s %10s %12s %10s\n","file","bytes","chunks",
+           "stage","warm MB/s","chunks/s","cold MB/s","chunks/s","total MB/s");
+  std::cout << line;
+  for(const Case &c : cases) {
+    std::string path = dir+"/"+c.name+".png";
+    double before_warm = 0, before_cold = 0; // time of the analysis up to the previous stage
+    bool cold_known = true;
+    for(const Stage &s : stages) {
+      PngOptions options;
+      options.inflate = s.inflate;
+      options.unfilter = s.unfilter;
+      std::vector<double> warm, cold;
+      analyse(c,path,options,false); // first run not measured
+      for(int r=0; r<runs; r++) warm.push_back(analyse(c,path,options,false));
+      bool dropped = cold_ok;
+      for(int r=0; r<runs && dropped; r++) {
+        dropped = dropCache(path);
+        cold.push_back(analyse(c,path,options,true));
+      }
+      double mb = c.data.size()/1e6, tw = median(warm);
+      snprintf(line,sizeof(line),"%-12s %10zu %8ld  %-8s",c.name.c_str(),c.data.size(),c.chunks,s.name);
+      std::cout << line << " " << rate(mb,tw-before_warm,10,1) << " " << rate(c.chunks,tw-before_warm,12,0);
+      cold_known = cold_known && dropped;
+      double tc = cold_known ? median(cold) : 0;
+      std::cout << " " << rate(mb,cold_known ? tc-before_cold : 0,10,1)
+                << " " << rate(c.chunks,cold_known ? tc-before_cold : 0,12,0)
+                << " " << rate(mb,tw,10,1) << "\n" << std::flush;
+      before_warm = tw;
+      before_cold = tc;
+    }
+  }
+
+  if(!keep) {
+    for(const Case &c : cases) std::remove((dir+"/"+c.name+".png").c_str());
+#ifndef _WIN32
+    rmdir(dir.c_str());
+#endif
+  }
+  return 0;
+}
@@ -0,0 +1,374 @@
+// Result cache shared by the runs (option --cache=DIR)
+//
+// Identical files analysed with the same options give the same report: the
+// output of an analysis is kept in the cache directory, keyed by the XXH64
+// hash of the content of the file, its size and a signature of the options.
+// A file found in the cache is hashed but not analysed.
+//
+//   DIR/index : hash table (open addressing, linear probing) memory mapped and
+//               shared by the processes (flock) and the threads (mutex);
+//               each entry gives a key, the size of its result and its place
+//               in the list of the entries by last use
+//   DIR/<hash>-<size>-<options> : the cached results
+//
+// The total size of the results is bounded: when a bound is exceeded, the
+// entries least recently used are removed (from the head of the list) until
+// the cache is back under a lower mark, so that the next stores have nothing
+// to remove. Only memory mapped files are cached (the content must
+// be hashed before the analysis).
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#include <atomic>
+#include <mutex>
+#include <cstdio>
+
+// XXH64 (https://github.com/Cyan4973/xxHash), XXH64("") = 0xEF46DB3751D8E999
+
+namespace xxh {
+
+const uint64_t P1 = 0x9E3779B185EBCA87ULL, P2 = 0xC2B2AE3D27D4EB4FULL, P3 = 0x165667B19E3779F9ULL,
+               P4 = 0x85EBCA77C2B2AE63ULL, P5 = 0x27D4EB2F165667C5ULL;
+
+inline uint64_t rotl(uint64_t x, int r) { return (x << r) | (x >> (64-r)); }
+
+inline uint64_t load64(const unsigned char *p) {
+  uint64_t v = 0;
+  for(int i=7; i>=0; i--) v = (v << 8) | p[i];
+  return v;
+}
+
+inline uint32_t load32(const unsigned char *p) {
+  return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+inline uint64_t round(uint64_t acc, uint64_t input) {
+  return rotl(acc + input*P2,31)*P1;
+}
+
+inline uint64_t merge(uint64_t acc, uint64_t v) {
+  return (acc ^ round(0,v))*P1 + P4;
+}
+
+uint64_t xxh64(const unsigned char *p, size_t len, uint64_t seed = 0) {
+  const unsigned char *end = p+len;
+  uint64_t h;
+  if(len >= 32) {
+    uint64_t v1 = seed+P1+P2, v2 = seed+P2, v3 = seed, v4 = seed-P1;
+    const unsigned char *limit = end-32;
+    do {
+      v1 = round(v1,load64(p));
+      v2 = round(v2,load64(p+8));
+      v3 = round(v3,load64(p+16));
+      v4 = round(v4,load64(p+24));
+      p += 32;
+    } while(p <= limit);
+    h = rotl(v1,1) + rotl(v2,7) + rotl(v3,12) + rotl(v4,18);
+    h = merge(merge(merge(merge(h,v1),v2),v3),v4);
+  }
+  else h = seed+P5;
+  h += len;
+  for(; p+8 <= end; p += 8) h = rotl(h ^ round(0,load64(p)),27)*P1 + P4;
+  if(p+4 <= end) {
+    h = rotl(h ^ (load32(p)*P1),23)*P2 + P3;
+    p += 4;
+  }
+  for(; p < end; p++) h = rotl(h ^ (*p*P5),11)*P1;
+  h ^= h >> 33;
+  h *= P2;
+  h ^= h >> 29;
+  h *= P3;
+  h ^= h >> 32;
+  return h;
+}
+
+}
+
+#ifndef _WIN32
+
+class ResultCache {
+public:
+  struct Key {
+    uint64_t hash, size, options;
+  };
+
+private:
+  static const uint32_t VERSION_NUMBER = 2;
+  static const uint32_t SLOTS = 1 << 16;
+  static const uint32_t NONE = 0xffffffff;
+
+  struct Header {
+    char     magic[8];
+    uint32_t version, slots;
+    uint32_t oldest, newest; // ends of the list of the entries by last use
+    uint64_t hits, misses;   // of all the runs
+    uint64_t bytes, entries;
+  };
+
+  struct Slot {
+    Key      key;
+    uint64_t bytes;          // 0: empty slot
+    uint32_t older, newer;   // neighbours in the list by last use
+  };
+
+  std::string dir;
+  uint64_t max_bytes;
+  std::mutex m;              // the threads of this process
+  int fd;                    // flock: the other processes
+  Header *header;
+  Slot *slots;
+
+  static size_t mapSize() { return sizeof(Header)+SLOTS*sizeof(Slot); }
+
+  static size_t home(const Key &k) {
+    return (size_t)((k.hash ^ k.size*xxh::P2 ^ k.options*xxh::P3) & (SLOTS-1));
+  }
+
+  static bool same(const Key &a, const Key &b) {
+    return a.hash == b.hash && a.size == b.size && a.options == b.options;
+  }
+
+  // index of the slot of the key, or of the empty slot where it would go
+  size_t find(const Key &k) {
+    size_t i = home(k);
+    while(slots[i].bytes && !same(slots[i].key,k)) i = (i+1) & (SLOTS-1);
+    return i;
+  }
+
+  std::string path(const Key &k) {
+    char name[64];
+    snprintf(name,sizeof(name),"/%016llx-%llu-%08llx",(unsigned long long)k.hash,
+             (unsigned long long)k.size,(unsigned long long)k.options);
+    return dir+name;
+  }
+
+  // list by last use: the entry of slot i is taken out, or put at the end
+  void detach(size_t i) {
+    Slot &s = slots[i];
+    if(s.older != NONE) slots[s.older].newer = s.newer;
+    else header->oldest = s.newer;
+    if(s.newer != NONE) slots[s.newer].older = s.older;
+    else header->newest = s.older;
+  }
+
+  void attachNewest(size_t i) {
+    slots[i].older = header->newest;
+    slots[i].newer = NONE;
+    if(header->newest != NONE) slots[header->newest].newer = (uint32_t) i;
+    else header->oldest = (uint32_t) i;
+    header->newest = (uint32_t) i;
+  }
+
+  // the entry of slot j goes to the empty slot i, its neighbours follow it
+  void move(size_t j, size_t i) {
+    slots[i] = slots[j];
+    if(slots[i].older != NONE) slots[slots[i].older].newer = (uint32_t) i;
+    else header->oldest = (uint32_t) i;
+    if(slots[i].newer != NONE) slots[slots[i].newer].older = (uint32_t) i;
+    else header->newest = (uint32_t) i;
+  }
+
+  // removes the entry of slot i; the following entries are moved back so that
+  // the probing sequences stay without holes
+  void erase(size_t i) {
+    unlink(path(slots[i].key).c_str());
+    header->bytes -= slots[i].bytes;
+    header->entries--;
+    detach(i);
+    size_t j = i;
+    for(;;) {
+      slots[i].bytes = 0;
+      for(;;) {
+        j = (j+1) & (SLOTS-1);
+        if(slots[j].bytes == 0) return;
+        size_t k = home(slots[j].key);
+        // the entry stays if its home is cyclically in (i,j]
+        if(i <= j ? (i < k && k <= j) : (i < k || k <= j)) continue;
+        break;
+      }
+      move(j,i);
+      i = j;
+    }
+  }
+
+  // when a bound is exceeded, the least recently used entries go until the
+  // cache is back under 7/8 of the size bound and 5/8 of the slots
+  void evict() {
+    if(header->bytes <= max_bytes && header->entries <= SLOTS/4*3) return;
+    while(header->entries && (header->bytes > max_bytes/8*7 || header->entries > SLOTS/8*5)) {
+      erase(header->oldest);
+    }
+  }
+
+  class Lock {
+    ResultCache &c;
+  public:
+    explicit Lock(ResultCache &cache) : c(cache) { c.m.lock(); flock(c.fd,LOCK_EX); }
+    ~Lock() { flock(c.fd,LOCK_UN); c.m.unlock(); }
+  };
+
+  static void put(std::string &s, uint64_t v, int n) {
+    for(int i=0; i<n; i++) s += (char)(v >> (8*i));
+  }
+
+  static uint64_t get(const unsigned char *p, int n) {
+    uint64_t v = 0;
+    for(int i=n-1; i>=0; i--) v = (v << 8) | p[i];
+    return v;
+  }
+
+  std::atomic<long> tmp_count;            // names of the temporary files
+
+public:
+  std::atomic<long> run_hits, run_misses; // of this run
+
+  ResultCache() : max_bytes(0), fd(-1), header(nullptr), slots(nullptr), tmp_count(0),
+                  run_hits(0), run_misses(0) {}
+  ~ResultCache() {
+    if(header) munmap((void*) header,mapSize());
+    if(fd >= 0) close(fd);
+  }
+
+  // returns false if the cache cannot be used
+  bool open(const std::string &directory, uint64_t max) {
+    dir = directory;
+    max_bytes = max;
+    mkdir(dir.c_str(),0777);
+    fd = ::open((dir+"/index").c_str(),O_RDWR | O_CREAT,0666);
+    if(fd < 0) return false;
+    flock(fd,LOCK_EX);
+    struct stat st;
+    bool fresh = fstat(fd,&st) != 0 || (size_t) st.st_size != mapSize();
+    if(fresh && (ftruncate(fd,0) != 0 || ftruncate(fd,mapSize()) != 0)) {
+      flock(fd,LOCK_UN);
+      return false;
+    }
+    void *p = mmap(nullptr,mapSize(),PROT_READ | PROT_WRITE,MAP_SHARED,fd,0);
+    if(p == MAP_FAILED) { flock(fd,LOCK_UN); return false; }
+    header = (Header*) p;
+    slots = (Slot*)(header+1);
+    if(fresh || memcmp(header->magic,"PNGanRes",8) != 0 || header->version != VERSION_NUMBER
+       || header->slots != SLOTS) {
+      memset(p,0,mapSize());
+      memcpy(header->magic,"PNGanRes",8);
+      header->version = VERSION_NUMBER;
+      header->slots = SLOTS;
+      header->oldest = header->newest = NONE;
+    }
+    evict(); // the bound may be lower than in the previous runs
+    flock(fd,LOCK_UN);
+    return true;
+  }
+
+  static Key key(const unsigned char *data, size_t size, uint64_t options) {
+    Key k;
+    k.hash = xxh::xxh64(data,size);
+    k.size = size;
+    k.options = options;
+    return k;
+  }
+
+  // the text and result of a previous analysis
+  bool lookup(const Key &k, std::string &text, PngResult &result) {
+    {
+      Lock lock(*this);
+      if(!slots[find(k)].bytes) {
+        header->misses++;
+        run_misses++;
+        return false;
+      }
+    }
+    // the file is read without the lock, the entry may go in the meantime
+    std::ifstream f(path(k),std::ifstream::binary);
+    std::string data((std::istreambuf_iterator<char>(f)),std::istreambuf_iterator<char>());
+    bool valid = data.size() >= 13;
+    {
+      Lock lock(*this);
+      size_t i = find(k);
+      if(valid) {
+        if(slots[i].bytes) { // the most recently used now
+          detach(i);
+          attachNewest(i);
+        }
+        header->hits++;
+        run_hits++;
+      }
+      else {
+        if(slots[i].bytes) erase(i); // its file is missing
+        header->misses++;
+        run_misses++;
+        return false;
+      }
+    }
+    const unsigned char *p = (const unsigned char *) data.data();
+    result.fatal_error = (int) get(p,4);
+    result.error_count = (long int) get(p+4,8);
+    result.signature_ok = p[12] != 0;
+    text.assign(data,13,std::string::npos);
+    return true;
+  }
+
+  // the file is written before the entry exists, and replaced by a rename
+  void store(const Key &k, const std::string &text, const PngResult &result) {
+    std::string data;
+    put(data,(uint32_t) result.fatal_error,4);
+    put(data,(uint64_t) result.error_count,8);
+    put(data,result.signature_ok,1);
+    data += text;
+    std::string name = path(k);
+    std::string tmp = name+".tmp"+std::to_string(getpid())+"-"+std::to_string(tmp_count++);
+    {
+      std::ofstream f(tmp,std::ofstream::binary);
+      if(!f.write(data.data(),data.size())) return;
+    }
+    if(std::rename(tmp.c_str(),name.c_str()) != 0) return;
+    Lock lock(*this);
+    size_t i = find(k);
+    if(slots[i].bytes) {
+      header->bytes -= slots[i].bytes;
+      detach(i);
+    }
+    else {
+      slots[i].key = k;
+      header->entries++;
+    }
+    slots[i].bytes = data.size();
+    attachNewest(i);
+    header->bytes += data.size();
+    evict();
+  }
+
+  uint64_t hits() const { return header->hits; }
+  uint64_t misses() const { return header->misses; }
+  uint64_t entries() const { return header->entries; }
+  uint64_t bytes() const { return header->bytes; }
+};
+
+#else
+
+// no mmap nor flock: the cache cannot be opened
+
+class ResultCache {
+public:
+  struct Key {
+    uint64_t hash, size, options;
+  };
+  std::atomic<long> run_hits, run_misses;
+
+  ResultCache() : run_hits(0), run_misses(0) {}
+  bool open(const std::string &directory, uint64_t max) { return false; }
+  static Key key(const unsigned char *data, size_t size, uint64_t options) { return Key(); }
+  bool lookup(const Key &k, std::string &text, PngResult &result) { return false; }
+  void store(const Key &k, const std::string &text, const PngResult &result) {}
+  uint64_t hits() const { return 0; }
+  uint64_t misses() const { return 0; }
+  uint64_t entries() const { return 0; }
+  uint64_t bytes() const { return 0; }
+};
+
+#endif
@@ -12,6 +12,18 @@
 #define READ_ERROR    512
 #define FILE_ERROR   1024
 
+// Chunk types
+//
+// The names below are used in the messages; the analysis compares chunk
+// types as 32 bits integers: the 4 letters in file order, big endian (FourCC)
+
+#include <cstdint>
+
+constexpr uint32_t fourcc(const char *s) {
+  return (uint32_t)(unsigned char)s[0] << 24 | (uint32_t)(unsigned char)s[1] << 16
+       | (uint32_t)(unsigned char)s[2] << 8  | (uint32_t)(unsigned char)s[3];
+}
+
 // Critical
 
 #define HEADER      "IHDR"
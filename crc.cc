@@ -0,0 +1,437 @@
+// CRC check (adapted from sample of recommandation document)
+//
+// Several engines compute the same CRC:
+// - table   : the reference, one byte at a time (from the recommandation document)
+// - slice8  : slicing-by-8, eight table lookups per 8 bytes
+// - slice16 : slicing-by-16
+// - clmul   : carry-less multiplication folding (x86 PCLMULQDQ or ARM PMULL), see
+//   "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ Instruction",
+//   V. Gopal, E. Ozturk et al., Intel, 2009
+// The fastest engine supported by the CPU is chosen at run time by init_crc(),
+// after checking it gives the same results as the reference.
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CRC_CLMUL_X86
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#if defined(__GNUC__) && defined(__aarch64__)
+#define CRC_CLMUL_ARM
+#include <arm_neon.h>
+#if defined(__linux__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+#endif
+
+uint32_t crc_table[16][256]; // crc_table[0] is the table of the recommandation document
+
+void make_crc_table() {
+  uint32_t c;
+  int n,k;
+
+  for(n=0; n<256; n++) {
+    c = (uint32_t) n;
+    for(k=0; k<8; k++) {
+      if(c & 1)
+        c = 0xedb88320L ^ (c >> 1);
+      else
+        c = c >> 1;
+    }
+    crc_table[0][n]=c;
+  }
+  // tables for the slicing algorithms: crc_table[k][n] is the CRC of n followed by k zeros
+  for(n=0; n<256; n++) {
+    c = crc_table[0][n];
+    for(k=1; k<16; k++) {
+      c = crc_table[0][c & 0xff] ^ (c >> 8);
+      crc_table[k][n]=c;
+    }
+  }
+}
+
+uint32_t update_crc_table(uint32_t crc, const unsigned char* buf, size_t len) {
+  uint32_t c = crc;
+  size_t n;
+
+  for(n=0; n<len; n++) {
+    c = crc_table[0][(unsigned int)((c ^ buf[n]) & 0xff)] ^ (c >> 8);
+  }
+  return c;
+}
+
+// little endian load, whatever the system (compilers turn it into a single load)
+inline uint32_t load_le32(const unsigned char *p) {
+  return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+uint32_t update_crc_slice8(uint32_t crc, const unsigned char* buf, size_t len) {
+  uint32_t c = crc;
+  for( ; len >= 8; len -= 8, buf += 8) {
+    uint32_t one = load_le32(buf) ^ c;
+    uint32_t two = load_le32(buf+4);
+    c = crc_table[7][one & 0xff] ^ crc_table[6][(one >> 8) & 0xff]
+      ^ crc_table[5][(one >> 16) & 0xff] ^ crc_table[4][one >> 24]
+      ^ crc_table[3][two & 0xff] ^ crc_table[2][(two >> 8) & 0xff]
+      ^ crc_table[1][(two >> 16) & 0xff] ^ crc_table[0][two >> 24];
+  }
+  return update_crc_table(c,buf,len);
+}
+
+uint32_t update_crc_slice16(uint32_t crc, const unsigned char* buf, size_t len) {
+  uint32_t c = crc;
+  for( ; len >= 16; len -= 16, buf += 16) {
+    uint32_t one = load_le32(buf) ^ c;
+    uint32_t two = load_le32(buf+4);
+    uint32_t three = load_le32(buf+8);
+    uint32_t four = load_le32(buf+12);
+    c = crc_table[15][one & 0xff] ^ crc_table[14][(one >> 8) & 0xff]
+      ^ crc_table[13][(one >> 16) & 0xff] ^ crc_table[12][one >> 24]
+      ^ crc_table[11][two & 0xff] ^ crc_table[10][(two >> 8) & 0xff]
+      ^ crc_table[9][(two >> 16) & 0xff] ^ crc_table[8][two >> 24]
+      ^ crc_table[7][three & 0xff] ^ crc_table[6][(three >> 8) & 0xff]
+      ^ crc_table[5][(three >> 16) & 0xff] ^ crc_table[4][three >> 24]
+      ^ crc_table[3][four & 0xff] ^ crc_table[2][(four >> 8) & 0xff]
+      ^ crc_table[1][(four >> 16) & 0xff] ^ crc_table[0][four >> 24];
+  }
+  return update_crc_slice8(c,buf,len);
+}
+
+// Folding constants (bit-reflected domain) given at the end of the Intel paper
+
+static const uint64_t crc_k1k2[2] = { 0x0154442bd4ULL, 0x01c6e41596ULL };
+static const uint64_t crc_k3k4[2] = { 0x01751997d0ULL, 0x00ccaa009eULL };
+static const uint64_t crc_k5k0[2] = { 0x0163cd6124ULL, 0x0000000000ULL };
+static const uint64_t crc_poly[2] = { 0x01db710641ULL, 0x01f7011641ULL }; // CRC32 + Barrett
+
+#ifdef CRC_CLMUL_X86
+
+// len must be at least 64 and a multiple of 16
+__attribute__((target("sse2,pclmul")))
+uint32_t crc_fold_x86(uint32_t crc, const unsigned char* buf, size_t len) {
+  __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+  x1 = _mm_loadu_si128((const __m128i *)(buf + 0x00));
+  x2 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+  x3 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+  x4 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+  x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+  x0 = _mm_loadu_si128((const __m128i *)crc_k1k2);
+  buf += 64;
+  len -= 64;
+
+  // fold 4 x 128 bits in parallel
+  while(len >= 64) {
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+    x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+    x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+    x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+    y5 = _mm_loadu_si128((const __m128i *)(buf + 0x00));
+    y6 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+    y7 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+    y8 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+    x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+    x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+    x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+    buf += 64;
+    len -= 64;
+  }
+
+  // fold into 128 bits
+  x0 = _mm_loadu_si128((const __m128i *)crc_k3k4);
+  x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+  x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+  x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+  // fold the remaining blocks of 16
+  while(len >= 16) {
+    x2 = _mm_loadu_si128((const __m128i *)buf);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    buf += 16;
+    len -= 16;
+  }
+
+  // fold 128 bits to 64 bits
+  x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+  x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+  x1 = _mm_srli_si128(x1, 8);
+  x1 = _mm_xor_si128(x1, x2);
+  x0 = _mm_loadl_epi64((const __m128i *)crc_k5k0);
+  x2 = _mm_srli_si128(x1, 4);
+  x1 = _mm_and_si128(x1, x3);
+  x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+
+  // Barrett reduction to 32 bits
+  x0 = _mm_loadu_si128((const __m128i *)crc_poly);
+  x2 = _mm_and_si128(x1, x3);
+  x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+  x2 = _mm_and_si128(x2, x3);
+  x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+
+  return (uint32_t)_mm_cvtsi128_si32(_mm_srli_si128(x1, 4));
+}
+
+bool crc_clmul_supported() {
+  unsigned int a, b, c, d;
+  if(!__get_cpuid(1, &a, &b, &c, &d)) return false;
+  return (c & bit_PCLMUL) && (d & bit_SSE2);
+}
+
+#define crc_fold crc_fold_x86
+
+#endif
+
+#ifdef CRC_CLMUL_ARM
+
+// same algorithm as crc_fold_x86, with the NEON equivalents of the SSE instructions
+
+#if defined(__clang__)
+#define CRC_ARM_TARGET __attribute__((target("crypto")))
+#else
+#define CRC_ARM_TARGET __attribute__((target("+crypto")))
+#endif
+
+// _mm_clmulepi64_si128 with selectors 0x00, 0x11 and 0x10
+CRC_ARM_TARGET
+static inline uint64x2_t pmull_lo(uint64x2_t a, uint64x2_t b) {
+  return vreinterpretq_u64_p128(vmull_p64((poly64_t)vgetq_lane_u64(a,0),(poly64_t)vgetq_lane_u64(b,0)));
+}
+CRC_ARM_TARGET
+static inline uint64x2_t pmull_hi(uint64x2_t a, uint64x2_t b) {
+  return vreinterpretq_u64_p128(vmull_p64((poly64_t)vgetq_lane_u64(a,1),(poly64_t)vgetq_lane_u64(b,1)));
+}
+CRC_ARM_TARGET
+static inline uint64x2_t pmull_lo_hi(uint64x2_t a, uint64x2_t b) {
+  return vreinterpretq_u64_p128(vmull_p64((poly64_t)vgetq_lane_u64(a,0),(poly64_t)vgetq_lane_u64(b,1)));
+}
+// _mm_srli_si128 by 8 and 4 bytes
+CRC_ARM_TARGET
+static inline uint64x2_t srli8(uint64x2_t a) {
+  return vreinterpretq_u64_u8(vextq_u8(vreinterpretq_u8_u64(a), vdupq_n_u8(0), 8));
+}
+CRC_ARM_TARGET
+static inline uint64x2_t srli4(uint64x2_t a) {
+  return vreinterpretq_u64_u8(vextq_u8(vreinterpretq_u8_u64(a), vdupq_n_u8(0), 4));
+}
+
+// len must be at least 64 and a multiple of 16
+CRC_ARM_TARGET
+uint32_t crc_fold_arm(uint32_t crc, const unsigned char* buf, size_t len) {
+  uint64x2_t x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+  x1 = vld1q_u64((const uint64_t *)(buf + 0x00));
+  x2 = vld1q_u64((const uint64_t *)(buf + 0x10));
+  x3 = vld1q_u64((const uint64_t *)(buf + 0x20));
+  x4 = vld1q_u64((const uint64_t *)(buf + 0x30));
+  x1 = veorq_u64(x1, vreinterpretq_u64_u32(vsetq_lane_u32(crc, vdupq_n_u32(0), 0)));
+  x0 = vld1q_u64(crc_k1k2);
+  buf += 64;
+  len -= 64;
+
+  while(len >= 64) {
+    x5 = pmull_lo(x1, x0);
+    x6 = pmull_lo(x2, x0);
+    x7 = pmull_lo(x3, x0);
+    x8 = pmull_lo(x4, x0);
+    x1 = pmull_hi(x1, x0);
+    x2 = pmull_hi(x2, x0);
+    x3 = pmull_hi(x3, x0);
+    x4 = pmull_hi(x4, x0);
+    y5 = vld1q_u64((const uint64_t *)(buf + 0x00));
+    y6 = vld1q_u64((const uint64_t *)(buf + 0x10));
+    y7 = vld1q_u64((const uint64_t *)(buf + 0x20));
+    y8 = vld1q_u64((const uint64_t *)(buf + 0x30));
+    x1 = veorq_u64(veorq_u64(x1, x5), y5);
+    x2 = veorq_u64(veorq_u64(x2, x6), y6);
+    x3 = veorq_u64(veorq_u64(x3, x7), y7);
+    x4 = veorq_u64(veorq_u64(x4, x8), y8);
+    buf += 64;
+    len -= 64;
+  }
+
+  x0 = vld1q_u64(crc_k3k4);
+  x5 = pmull_lo(x1, x0);
+  x1 = pmull_hi(x1, x0);
+  x1 = veorq_u64(veorq_u64(x1, x2), x5);
+  x5 = pmull_lo(x1, x0);
+  x1 = pmull_hi(x1, x0);
+  x1 = veorq_u64(veorq_u64(x1, x3), x5);
+  x5 = pmull_lo(x1, x0);
+  x1 = pmull_hi(x1, x0);
+  x1 = veorq_u64(veorq_u64(x1, x4), x5);
+
+  while(len >= 16) {
+    x2 = vld1q_u64((const uint64_t *)buf);
+    x5 = pmull_lo(x1, x0);
+    x1 = pmull_hi(x1, x0);
+    x1 = veorq_u64(veorq_u64(x1, x2), x5);
+    buf += 16;
+    len -= 16;
+  }
+
+  static const uint32_t mask[4] = { ~0u, 0, ~0u, 0 };
+  x2 = pmull_lo_hi(x1, x0);
+  x3 = vreinterpretq_u64_u32(vld1q_u32(mask));
+  x1 = srli8(x1);
+  x1 = veorq_u64(x1, x2);
+  x0 = vld1q_u64(crc_k5k0);
+  x2 = srli4(x1);
+  x1 = vandq_u64(x1, x3);
+  x1 = pmull_lo(x1, x0);
+  x1 = veorq_u64(x1, x2);
+
+  x0 = vld1q_u64(crc_poly);
+  x2 = vandq_u64(x1, x3);
+  x2 = pmull_lo_hi(x2, x0);
+  x2 = vandq_u64(x2, x3);
+  x2 = pmull_lo(x2, x0);
+  x1 = veorq_u64(x1, x2);
+
+  return vgetq_lane_u32(vreinterpretq_u32_u64(x1), 1);
+}
+
+bool crc_clmul_supported() {
+#if defined(__linux__) && defined(HWCAP_PMULL)
+  return (getauxval(AT_HWCAP) & HWCAP_PMULL) != 0;
+#elif defined(__APPLE__)
+  return true; // all Apple ARM processors have PMULL
+#else
+  return false;
+#endif
+}
+
+#define crc_fold crc_fold_arm
+
+#endif
+
+#ifdef crc_fold
+
+uint32_t update_crc_clmul(uint32_t crc, const unsigned char* buf, size_t len) {
+  if(len < 64) return update_crc_slice16(crc,buf,len);
+  size_t n = len & ~(size_t)15;
+  crc = crc_fold(crc,buf,n);
+  return update_crc_slice16(crc,buf+n,len-n);
+}
+
+#endif
+
+// Engine selection
+
+typedef uint32_t (*crc_function)(uint32_t crc, const unsigned char* buf, size_t len);
+
+struct CrcEngine {
+  const char   *name;
+  crc_function  update;
+  bool          available;
+};
+
+CrcEngine crc_engines[] = {
+  { "table",   update_crc_table,   true },
+  { "slice8",  update_crc_slice8,  true },
+  { "slice16", update_crc_slice16, true },
+#ifdef crc_fold
+  { "clmul",   update_crc_clmul,   false }, // depends on the CPU
+#endif
+};
+const int crc_engine_count = sizeof(crc_engines)/sizeof(crc_engines[0]);
+
+crc_function update_crc_engine = update_crc_table;
+const char  *crc_engine_name = "table";
+
+uint32_t update_crc(uint32_t crc, const unsigned char* buf, size_t len) {
+  return update_crc_engine(crc,buf,len);
+}
+
+// compares an engine with the reference on various lengths and alignments
+
+bool crc_self_test(crc_function update) {
+  unsigned char buf[1024+16];
+  uint32_t r = 1;
+  for(size_t i=0; i<sizeof(buf); i++) {
+    r = r*1103515245u + 12345u;
+    buf[i] = (unsigned char)(r >> 16);
+  }
+  const unsigned char check[] = "123456789";
+  if((update(0xffffffffL,check,9) ^ 0xffffffffL) != 0xcbf43926L) return false;
+  const size_t lengths[] = { 0, 1, 7, 15, 16, 63, 64, 65, 127, 128, 200, 1000, 1024 };
+  for(size_t offset=0; offset<16; offset+=5) {
+    for(size_t len : lengths) {
+      if(update(0xffffffffL,buf+offset,len) != update_crc_table(0xffffffffL,buf+offset,len))
+        return false;
+    }
+  }
+  return true;
+}
+
+// builds the tables and selects an engine: the one given by name (returns false
+// if it is not available), or by default the last (fastest) available one
+
+bool init_crc(const char *name = nullptr) {
+  make_crc_table();
+#ifdef crc_fold
+  crc_engines[crc_engine_count-1].available = crc_clmul_supported();
+#endif
+  for(int i=0; i<crc_engine_count; i++) {
+    CrcEngine &e = crc_engines[i];
+    if(!e.available || !crc_self_test(e.update)) {
+      e.available = false;
+      continue;
+    }
+    if(name == nullptr || strcmp(name,e.name)==0) {
+      update_crc_engine = e.update;
+      crc_engine_name = e.name;
+      if(name) return true;
+    }
+  }
+  return name == nullptr;
+}
+
+// CRC of a big buffer, computed by segments on the thread pool
+// the partial CRCs are merged with zlib's crc32_combine
+// buffers smaller than parallel_crc_min stay on the serial path
+
+const size_t parallel_crc_min = 1 << 22;     // 4 MB
+const size_t parallel_crc_segment = 1 << 20; // at least 1 MB per task
+
+uint32_t update_crc_parallel(uint32_t crc, const unsigned char* buf, size_t len) {
+  if(len < parallel_crc_min || jobs == 1) return update_crc(crc,buf,len);
+  ThreadPool &p = getPool();
+  if(p.size() < 2) return update_crc(crc,buf,len);
+
+  size_t segment = std::max(parallel_crc_segment,len/(4*p.size())+1);
+  size_t count = (len+segment-1)/segment;
+  std::vector<uint32_t> partial(count);
+  ThreadPool::Group group;
+  for(size_t i=0; i<count; i++) {
+    p.submit(group,[&partial,buf,len,segment,i]() {
+      size_t start = i*segment;
+      size_t n = std::min(segment,len-start);
+      partial[i] = update_crc(0xffffffffL,buf+start,n) ^ 0xffffffffL;
+    });
+  }
+  p.wait(group);
+
+  // crc32_combine works on finished CRCs, hence the xors
+  uLong c = crc ^ 0xffffffffL;
+  for(size_t i=0; i<count; i++) {
+    size_t n = std::min(segment,len-i*segment);
+    c = crc32_combine(c,partial[i],(z_off_t)n);
+  }
+  return (uint32_t)c ^ 0xffffffffL;
+}
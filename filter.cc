@@ -0,0 +1,348 @@
+// Reconstruction of the filtered rows of the image (PNG specification, section 9)
+//
+// Each row of the decompressed image data starts with its filter type:
+// 0 None, 1 Sub, 2 Up, 3 Average, 4 Paeth. The unfilter functions rebuild
+// the row in place from the previous (already rebuilt) row.
+//
+// Several engines do the same work:
+// - scalar : the reference, one byte at a time
+// - sse2   : x86, one pixel of 3, 4, 6 or 8 bytes per step for Sub, Average
+//            and Paeth (the bytes of a pixel are independent), 16 bytes per
+//            step for Up (as in libpng's filter_sse2_intrinsics.c)
+// - avx2   : the same, with Up 32 bytes per step
+// - neon   : ARM, as sse2
+// Sub, Average and Paeth depend on the pixel just rebuilt on the left, so wider
+// vectors only help Up. Pixels of 1 or 2 bytes stay on the scalar code.
+// The fastest engine supported by the CPU is chosen at run time by init_filters(),
+// after checking it gives the same results as the reference.
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define FILTER_X86
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#if defined(__GNUC__) && (defined(__aarch64__) || defined(__ARM_NEON))
+#define FILTER_NEON
+#include <arm_neon.h>
+#endif
+
+typedef void (*unfilter_function)(int type, unsigned char *row, const unsigned char *prev,
+                                  size_t len, unsigned bpp);
+
+// Reference
+// row: the row without its filter type byte, len bytes
+// prev: the previous row after reconstruction (zeros for the first row)
+// bpp: bytes per complete pixel, at least 1
+
+inline unsigned char paeth(int a, int b, int c) {
+  int p = a+b-c;
+  int pa = abs(p-a);
+  int pb = abs(p-b);
+  int pc = abs(p-c);
+  if(pa <= pb && pa <= pc) return (unsigned char) a;
+  if(pb <= pc) return (unsigned char) b;
+  return (unsigned char) c;
+}
+
+// continues the reconstruction of a row from byte "start" (the bytes before are rebuilt)
+
+void unfilter_scalar_from(int type, unsigned char *row, const unsigned char *prev, size_t start,
+                          size_t len, unsigned bpp) {
+  size_t i = start;
+  switch(type) {
+  case 1 : // Sub
+    for(i=std::max(i,(size_t)bpp); i<len; i++) row[i] += row[i-bpp];
+    break;
+  case 2 : // Up
+    for( ; i<len; i++) row[i] += prev[i];
+    break;
+  case 3 : // Average
+    for( ; i<bpp && i<len; i++) row[i] += prev[i] >> 1;
+    for( ; i<len; i++) row[i] += (row[i-bpp]+prev[i]) >> 1;
+    break;
+  case 4 : // Paeth
+    for( ; i<bpp && i<len; i++) row[i] += prev[i]; // paeth(0,b,0) = b
+    for( ; i<len; i++) row[i] += paeth(row[i-bpp],prev[i],prev[i-bpp]);
+    break;
+  default : // None
+    break;
+  }
+}
+
+void unfilter_scalar(int type, unsigned char *row, const unsigned char *prev, size_t len, unsigned bpp) {
+  unfilter_scalar_from(type,row,prev,0,len,bpp);
+}
+
+#ifdef FILTER_X86
+
+// one pixel of BPP bytes (at most 8) in the low bytes of a register
+
+template<unsigned BPP>
+__attribute__((target("sse2")))
+inline __m128i load_pixel(const unsigned char *p) {
+  uint64_t v = 0;
+  memcpy(&v,p,BPP);
+  return _mm_loadl_epi64((const __m128i *) &v);
+}
+
+template<unsigned BPP>
+__attribute__((target("sse2")))
+inline void store_pixel(unsigned char *p, __m128i x) {
+  uint64_t v;
+  _mm_storel_epi64((__m128i *) &v,x);
+  memcpy(p,&v,BPP);
+}
+
+// the pixels are processed while a whole pixel is left, the scalar code ends the row
+
+template<unsigned BPP>
+__attribute__((target("sse2")))
+void unfilter_sse2_pixels(int type, unsigned char *row, const unsigned char *prev, size_t len) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i one = _mm_set1_epi8(1);
+  __m128i a = zero, c = zero; // left and upper left pixels
+  size_t i = 0;
+  switch(type) {
+  case 1 : // Sub
+    for( ; i+BPP<=len; i+=BPP) {
+      a = _mm_add_epi8(load_pixel<BPP>(row+i),a);
+      store_pixel<BPP>(row+i,a);
+    }
+    break;
+  case 3 : // Average: _mm_avg_epu8 rounds up, the correction makes it round down
+    for( ; i+BPP<=len; i+=BPP) {
+      __m128i b = load_pixel<BPP>(prev+i);
+      __m128i avg = _mm_avg_epu8(a,b);
+      avg = _mm_sub_epi8(avg,_mm_and_si128(_mm_xor_si128(a,b),one));
+      a = _mm_add_epi8(load_pixel<BPP>(row+i),avg);
+      store_pixel<BPP>(row+i,a);
+    }
+    break;
+  case 4 : // Paeth, on 16 bits so that the differences do not overflow
+    for( ; i+BPP<=len; i+=BPP) {
+      __m128i b = _mm_unpacklo_epi8(load_pixel<BPP>(prev+i),zero);
+      __m128i a16 = _mm_unpacklo_epi8(a,zero);
+      __m128i pa = _mm_sub_epi16(b,c);   // p-a
+      __m128i pb = _mm_sub_epi16(a16,c); // p-b
+      __m128i pc = _mm_add_epi16(pa,pb); // p-c
+      pa = _mm_max_epi16(pa,_mm_sub_epi16(zero,pa));
+      pb = _mm_max_epi16(pb,_mm_sub_epi16(zero,pb));
+      pc = _mm_max_epi16(pc,_mm_sub_epi16(zero,pc));
+      __m128i smallest = _mm_min_epi16(pc,_mm_min_epi16(pa,pb));
+      __m128i is_a = _mm_cmpeq_epi16(smallest,pa);
+      __m128i is_b = _mm_cmpeq_epi16(smallest,pb);
+      __m128i nearest = _mm_or_si128(_mm_and_si128(is_b,b),_mm_andnot_si128(is_b,c));
+      nearest = _mm_or_si128(_mm_and_si128(is_a,a16),_mm_andnot_si128(is_a,nearest));
+      a = _mm_add_epi8(load_pixel<BPP>(row+i),_mm_packus_epi16(nearest,nearest));
+      store_pixel<BPP>(row+i,a);
+      c = b;
+    }
+    break;
+  }
+  if(i < len) unfilter_scalar_from(type,row,prev,i,len,BPP); // not for rows of complete pixels
+}
+
+__attribute__((target("sse2")))
+void unfilter_up_sse2(unsigned char *row, const unsigned char *prev, size_t len) {
+  size_t i = 0;
+  for( ; i+16<=len; i+=16) {
+    __m128i x = _mm_loadu_si128((const __m128i *)(row+i));
+    __m128i b = _mm_loadu_si128((const __m128i *)(prev+i));
+    _mm_storeu_si128((__m128i *)(row+i),_mm_add_epi8(x,b));
+  }
+  for( ; i<len; i++) row[i] += prev[i];
+}
+
+__attribute__((target("avx2")))
+void unfilter_up_avx2(unsigned char *row, const unsigned char *prev, size_t len) {
+  size_t i = 0;
+  for( ; i+32<=len; i+=32) {
+    __m256i x = _mm256_loadu_si256((const __m256i *)(row+i));
+    __m256i b = _mm256_loadu_si256((const __m256i *)(prev+i));
+    _mm256_storeu_si256((__m256i *)(row+i),_mm256_add_epi8(x,b));
+  }
+  unfilter_up_sse2(row+i,prev+i,len-i);
+}
+
+void unfilter_pixels_sse2(int type, unsigned char *row, const unsigned char *prev, size_t len, unsigned bpp) {
+  switch(bpp) {
+  case 3 : unfilter_sse2_pixels<3>(type,row,prev,len); break;
+  case 4 : unfilter_sse2_pixels<4>(type,row,prev,len); break;
+  case 6 : unfilter_sse2_pixels<6>(type,row,prev,len); break;
+  case 8 : unfilter_sse2_pixels<8>(type,row,prev,len); break;
+  default : unfilter_scalar(type,row,prev,len,bpp);
+  }
+}
+
+void unfilter_sse2(int type, unsigned char *row, const unsigned char *prev, size_t len, unsigned bpp) {
+  if(type == 2) unfilter_up_sse2(row,prev,len);
+  else if(type != 0) unfilter_pixels_sse2(type,row,prev,len,bpp);
+}
+
+void unfilter_avx2(int type, unsigned char *row, const unsigned char *prev, size_t len, unsigned bpp) {
+  if(type == 2) unfilter_up_avx2(row,prev,len);
+  else if(type != 0) unfilter_pixels_sse2(type,row,prev,len,bpp);
+}
+
+bool filter_sse2_supported() {
+  unsigned int a, b, c, d;
+  if(!__get_cpuid(1, &a, &b, &c, &d)) return false;
+  return (d & bit_SSE2) != 0;
+}
+
+bool filter_avx2_supported() {
+  unsigned int a, b, c, d;
+  if(!__get_cpuid(1, &a, &b, &c, &d)) return false;
+  if(!(c & bit_OSXSAVE) || !(c & bit_AVX)) return false;
+  unsigned int lo, hi;
+  __asm__ ("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+  if((lo & 6) != 6) return false; // the system does not save the AVX registers
+  if(!__get_cpuid_count(7, 0, &a, &b, &c, &d)) return false;
+  return (b & bit_AVX2) != 0;
+}
+
+#endif
+
+#ifdef FILTER_NEON
+
+template<unsigned BPP>
+inline uint8x8_t load_pixel_neon(const unsigned char *p) {
+  uint64_t v = 0;
+  memcpy(&v,p,BPP);
+  return vcreate_u8(v);
+}
+
+template<unsigned BPP>
+inline void store_pixel_neon(unsigned char *p, uint8x8_t x) {
+  uint64_t v = vget_lane_u64(vreinterpret_u64_u8(x),0);
+  memcpy(p,&v,BPP);
+}
+
+template<unsigned BPP>
+void unfilter_neon_pixels(int type, unsigned char *row, const unsigned char *prev, size_t len) {
+  uint8x8_t a = vdup_n_u8(0), c = vdup_n_u8(0);
+  size_t i = 0;
+  switch(type) {
+  case 1 : // Sub
+    for( ; i+BPP<=len; i+=BPP) {
+      a = vadd_u8(load_pixel_neon<BPP>(row+i),a);
+      store_pixel_neon<BPP>(row+i,a);
+    }
+    break;
+  case 3 : // Average: vhadd rounds down as required
+    for( ; i+BPP<=len; i+=BPP) {
+      a = vadd_u8(load_pixel_neon<BPP>(row+i),vhadd_u8(a,load_pixel_neon<BPP>(prev+i)));
+      store_pixel_neon<BPP>(row+i,a);
+    }
+    break;
+  case 4 : // Paeth (as in libpng's filter_neon_intrinsics.c)
+    for( ; i+BPP<=len; i+=BPP) {
+      uint8x8_t b = load_pixel_neon<BPP>(prev+i);
+      uint16x8_t pa = vabdl_u8(b,c);                          // |p-a|
+      uint16x8_t pb = vabdl_u8(a,c);                          // |p-b|
+      uint16x8_t pc = vabdq_u16(vaddl_u8(a,b),vaddl_u8(c,c)); // |p-c|
+      uint8x8_t is_a = vmovn_u16(vandq_u16(vcleq_u16(pa,pb),vcleq_u16(pa,pc)));
+      uint8x8_t is_b = vmovn_u16(vcleq_u16(pb,pc));
+      uint8x8_t nearest = vbsl_u8(is_a,a,vbsl_u8(is_b,b,c));
+      a = vadd_u8(load_pixel_neon<BPP>(row+i),nearest);
+      store_pixel_neon<BPP>(row+i,a);
+      c = b;
+    }
+    break;
+  }
+  if(i < len) unfilter_scalar_from(type,row,prev,i,len,BPP);
+}
+
+void unfilter_neon(int type, unsigned char *row, const unsigned char *prev, size_t len, unsigned bpp) {
+  if(type == 2) {
+    size_t i = 0;
+    for( ; i+16<=len; i+=16) vst1q_u8(row+i,vaddq_u8(vld1q_u8(row+i),vld1q_u8(prev+i)));
+    for( ; i<len; i++) row[i] += prev[i];
+    return;
+  }
+  if(type == 0) return;
+  switch(bpp) {
+  case 3 : unfilter_neon_pixels<3>(type,row,prev,len); break;
+  case 4 : unfilter_neon_pixels<4>(type,row,prev,len); break;
+  case 6 : unfilter_neon_pixels<6>(type,row,prev,len); break;
+  case 8 : unfilter_neon_pixels<8>(type,row,prev,len); break;
+  default : unfilter_scalar(type,row,prev,len,bpp);
+  }
+}
+
+#endif
+
+// Engine selection
+
+struct FilterEngine {
+  const char        *name;
+  unfilter_function  unfilter;
+  bool               available;
+};
+
+FilterEngine filter_engines[] = {
+  { "scalar", unfilter_scalar, true },
+#ifdef FILTER_X86
+  { "sse2",   unfilter_sse2,   false }, // depends on the CPU
+  { "avx2",   unfilter_avx2,   false },
+#endif
+#ifdef FILTER_NEON
+  { "neon",   unfilter_neon,   true },  // always there when the compiler targets it
+#endif
+};
+const int filter_engine_count = sizeof(filter_engines)/sizeof(filter_engines[0]);
+
+unfilter_function unfilter = unfilter_scalar;
+const char       *filter_engine_name = "scalar";
+
+// compares an engine with the reference on random rows, for all filter types
+// and pixel sizes
+
+bool filter_self_test(unfilter_function f) {
+  const size_t max_len = 8*37;
+  unsigned char prev[max_len], row[max_len], expected[max_len];
+  uint32_t r = 7;
+  const unsigned bpps[] = { 1, 2, 3, 4, 6, 8 };
+  const size_t pixels[] = { 1, 2, 5, 16, 37 };
+  for(unsigned bpp : bpps) {
+    for(size_t n : pixels) {
+      size_t len = n*bpp - (n > 2 ? bpp/2 : 0); // some rows end with an incomplete pixel
+      for(int type=0; type<5; type++) {
+        for(size_t i=0; i<len; i++) {
+          r = r*1103515245u + 12345u;
+          prev[i] = (unsigned char)(r >> 16);
+          r = r*1103515245u + 12345u;
+          row[i] = expected[i] = (unsigned char)(r >> 16);
+        }
+        unfilter_scalar(type,expected,prev,len,bpp);
+        f(type,row,prev,len,bpp);
+        if(memcmp(row,expected,len) != 0) return false;
+      }
+    }
+  }
+  return true;
+}
+
+// selects an engine: the one given by name (returns false if it is not
+// available), or by default the last (fastest) available one
+
+bool init_filters(const char *name = nullptr) {
+#ifdef FILTER_X86
+  filter_engines[1].available = filter_sse2_supported();
+  filter_engines[2].available = filter_sse2_supported() && filter_avx2_supported();
+#endif
+  for(int i=0; i<filter_engine_count; i++) {
+    FilterEngine &e = filter_engines[i];
+    if(!e.available || !filter_self_test(e.unfilter)) {
+      e.available = false;
+      continue;
+    }
+    if(name == nullptr || strcmp(name,e.name)==0) {
+      unfilter = e.unfilter;
+      filter_engine_name = e.name;
+      if(name) return true;
+    }
+  }
+  return name == nullptr;
+}
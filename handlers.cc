@@ -1,13 +1,10 @@
-// Handlers
+// Handlers (members of the class Analysis, see libpngan.cc)
 
-bool readKeyword(const char* key_text, bool output) {
-  using std::cout;
+bool Analysis::readKeyword(const char* key_text, bool output) {
   // returns false if chunk processing shall stop
 
   int sz = (chunk_length < 80) ? chunk_length : 80;
   // sz is at most 80
-  chunk_data.resize(sz);
-  if(!ifs.read(chunk_data.data(),sz)) call_err();
 
   bool null_found=false;
   bool printable=true;
@@ -16,42 +13,41 @@ bool readKeyword(const char* key_text, bool output) {
   for(index=0; index<sz && !null_found; index++) {
     d=(unsigned char) chunk_data[index];
     null_found = d==0;
-    printable=printable && (d==0 || (d>=32u && d<=126u) || (d>=161u && d<=255u));
+    printable=printable && (d==0 || (d>=32u && d<=126u) || d>=161u);
   }
   
   if(!null_found) {
-    cout << "Error: Keyword missing or too long (should be < 80 characters)\n";
-    error_count++;
+    error() << "Error: Keyword missing or too long (should be < 80 characters)\n";
     return false;
   }
 
-  ifs.seekg(chunk_start);
-  ifs.seekg(index,std::ios_base::cur);
+  chunk_pos = index;
+  keyword.clear();
+  latin1_to_utf8(chunk_data,index-1,keyword);
 
   if(!printable) {
-    cout << "Error: Keyword contains non pritable characters (should be latin1 encoded with char codes in 32-126 or 161-255)\n";
-    error_count++;
+    error() << "Error: Keyword contains non pritable characters (should be latin1 encoded with char codes in 32-126 or 161-255)\n";
   }
   
   if(output) {
-    char keyword[100];
-    strcpy(keyword,chunk_data.data());
-    cout << key_text << latin1_to_utf8(keyword,index-1) << "\"\n";
-    // if index = 0, this is not a problem because latin1_to_utf8(-1) will just do nothing
+    out << key_text << keyword << "\"\n";
   }
   
   return true;
-  // in this case file position is just after the null string terminator
+  // in this case chunk_pos is just after the null string terminator
   // or at the end of the chunk if chunk_length = 0 (then the PNG is malformed)
 }
 
-void output_ztext(char *buffer, size_t len, const char* head_text, const char* trail_text, bool latin1, std::ostream &dest = std::cout) {
-  using std::cout;
-  const uint32_t MORSEL = 1 << 17; // 128K
+// inflates the buffer to dest, the text is also appended to *copy if not null,
+// and checked by *utf8 if not null (as it comes, the whole text is never needed)
+
+void Analysis::output_ztext(const unsigned char *buffer, size_t len, const char* head_text, const char* trail_text, bool latin1, std::ostream &dest, std::string *copy, Utf8Validator *utf8) {
+  const uint32_t ZTEXT_BLOCK = 1 << 17; // 128K, the text is inflated by blocks
 
   int ret;
   z_stream strm;
-  unsigned char out[MORSEL];
+  if(ztext_block.size() < ZTEXT_BLOCK) ztext_block.resize(ZTEXT_BLOCK); // not on the stack of the thread
+  unsigned char *morsel = ztext_block.data();
 
   strm.zalloc = Z_NULL;
   strm.zfree = Z_NULL;
@@ -60,8 +56,7 @@ void output_ztext(char *buffer, size_t len, const char* head_text, const char* t
   strm.next_in = Z_NULL;
   ret = inflateInit(&strm);
   if (ret != Z_OK) {
-    cout << "Error initializing zlib...\n";
-    error_count++;
+    error() << "Error initializing zlib...\n";
     return;
   } 
 
@@ -69,44 +64,52 @@ void output_ztext(char *buffer, size_t len, const char* head_text, const char* t
   
   uint32_t delta;
   size_t i=0;
+  std::string morsel_text; // latin-1: the text of a morsel, when there is no copy to append it to
 
   do {
     if(len==i) {
-      cout << "\nError while deflating: chunk finished before any ending marker was reached\n";
-      error_count++;
+      error() << "\nError while deflating: chunk finished before any ending marker was reached\n";
       goto fin;
     }
-    if(len>i+MORSEL) delta=MORSEL;
+    if(len>i+ZTEXT_BLOCK) delta=ZTEXT_BLOCK;
     else delta = (uint32_t)(len-i);
     strm.avail_in = delta;
-    strm.next_in = (unsigned char *)buffer+i;
+    strm.next_in = (unsigned char *)buffer+i; // zlib does not modify the input
     i += delta;
+    int64_t fed = delta; // counted once by the timer
     do {
-      strm.avail_out = MORSEL;
-      strm.next_out = out;
-      ret = inflate(&strm, Z_NO_FLUSH);
+      strm.avail_out = ZTEXT_BLOCK;
+      strm.next_out = morsel;
+      {
+        PhaseTimer::Scope t(timer,PhaseTimer::INFLATE,fed);
+        fed = 0;
+        ret = inflate(&strm, Z_NO_FLUSH);
+      }
       switch (ret) {
         case Z_NEED_DICT:
-          cout << "\"\nZ_NEED_DICT error while deflating... error code " << ret << "\n";
-          error_count++;
+          error() << "\"\nZ_NEED_DICT error while deflating... error code " << ret << "\n";
           ret = Z_DATA_ERROR;
           goto fin;
         case Z_DATA_ERROR:
-          cout << "\"\nZ_DATA error while deflating... error code " << ret << "\n";
-          error_count++;
+          error() << "\"\nZ_DATA error while deflating... error code " << ret << "\n";
           goto fin;
         case Z_MEM_ERROR:
-          cout << "\"\nZ_MEM error while deflating... error code " << ret << "\n";
-          error_count++;
+          error() << "\"\nZ_MEM error while deflating... error code " << ret << "\n";
           goto fin;
       }
 
-      uint32_t have = MORSEL - strm.avail_out;
+      uint32_t have = ZTEXT_BLOCK - strm.avail_out;
       if(latin1) {
-        dest << latin1_to_utf8(out,have);
+        std::string &text = copy ? *copy : morsel_text;
+        size_t start = copy ? copy->size() : 0;
+        if(!copy) morsel_text.clear();
+        latin1_to_utf8(morsel,have,text);
+        dest.write(text.data()+start,text.size()-start);
       }
       else {
-        dest.write((char *)out,have);
+        if(utf8) utf8->feed(morsel,have);
+        dest.write((char *)morsel,have);
+        if(copy) copy->append((char *)morsel,have);
       }
 
     } while (strm.avail_out == 0);
@@ -119,32 +122,29 @@ fin:
   if(ret==Z_STREAM_END) dest << trail_text;
 }
 
-void handleHeader(bool output) {
-  using std::cout;
+void Analysis::handleHeader(bool output) {
   
   if(chunk_length!=13) {
-    cout << "Fatal Error: header chunk should be 13 bytes long\n";
+    out << "Fatal Error: header chunk should be 13 bytes long\n";
   }
   else {
     
-    readNumber(4,width,true);
-    if(output) { cout << "    Width: " << width << "\n"; }
+    readNumber<4,true>(width);
+    if(output) { out << "    Width: " << width << "\n"; }
     if(width<0) {
-      cout << "Error: negative width";
-      error_count++;
+      error() << "Error: negative width";
     }
     
-    readNumber(4,height,true);
-    if(output) { cout << "    Height: " << height << "\n"; }
+    readNumber<4,true>(height);
+    if(output) { out << "    Height: " << height << "\n"; }
     if(height<0) {
-      cout << "Error: negative height";
-      error_count++;
+      error() << "Error: negative height";
     }
     
-    readNumber(1,bit_depth,false);
-    if(output) { cout << "    Bit depth: " << (int) bit_depth << "\n"; }
+    readNumber<1,false>(bit_depth);
+    if(output) { out << "    Bit depth: " << (int) bit_depth << "\n"; }
     
-    readNumber(1,color_type,false);
+    readNumber<1,false>(color_type);
     bool good_color;
     char aux2[10];
     if(color_type>7) {
@@ -158,410 +158,488 @@ void handleHeader(bool output) {
       aux2[3] = color_type & 4 ? '1' : '0';
       aux2[4] = 0;
     }
-    if(output) { cout << "    Color type: " << (int) color_type; }
+    if(output) { out << "    Color type: " << (int) color_type; }
     if(good_color) {
-      if(output) { cout << " (" << aux2 << ")"; }
+      if(output) { out << " (" << aux2 << ")"; }
     }
-    if(output) { cout << "\n"; }
+    if(output) { out << "\n"; }
     
-    readNumber(1,compression,false);
-    if(output) { cout << "    Compression: " << (int) compression << "\n"; }
+    readNumber<1,false>(compression);
+    if(output) { out << "    Compression: " << (int) compression << "\n"; }
     bool good_compression = (compression == 0);
     
-    readNumber(1,filter,false);
-    if(output) { cout << "    Filter: " << (int) filter << "\n"; }
+    readNumber<1,false>(filter);
+    if(output) { out << "    Filter: " << (int) filter << "\n"; }
     bool good_filter = (compression == 0);
     
-    readNumber(1,interlace,false);
-    if(output) { cout << "    Interlace: " << (int) interlace << "\n"; }
+    readNumber<1,false>(interlace);
+    if(output) { out << "    Interlace: " << (int) interlace << "\n"; }
         
     if(!good_color) {
-      cout << "Error: color type has no meaning";
-      error_count++;
+      error() << "Error: color type has no meaning";
     }
     else {
       palette_used = color_type & 1;
       color_used = color_type & 2;
       alpha_used = color_type & 4;
-      if(output) { cout << "\n  Interpretation: " 
+      if(output) { out << "\n  Interpretation: " 
            << (palette_used ? "palette used" : "no palette")
            << ", "
            << (color_used   ? "color used" : "no color")
            << ", "
            << (alpha_used ? "alpha channel used" : "no alpha channel")
            << "\n" ;
-      cout << "  meaning: "; }
+      out << "  meaning: "; }
       
       switch(color_type) {
       case 0 : {
         switch(bit_depth) {
         case 1 : case 2 : case 4 : case 8 : case 16 : {
-          if(output) { cout << "Monochrome with " << (1 << bit_depth) << " gray levels"; }
+          if(output) { out << "Monochrome with " << (1 << bit_depth) << " gray levels"; }
         } break;
         default : {
-          cout << "\n  Error: forbidden value of bit depth (should be 1,2,4,8 or 16 for color type 0)";
-          error_count++;
+          error() << "\n  Error: forbidden value of bit depth (should be 1,2,4,8 or 16 for color type 0)";
         }
         };
       } break;
       case 2 : {
         switch(bit_depth) {
         case 8 : case 16 : {
-          if(output) { cout << "True color with " << (1 << bit_depth) << " levels of R, G and B"; }
+          if(output) { out << "True color with " << (1 << bit_depth) << " levels of R, G and B"; }
         } break;
         default : {
-          cout << "\n  Error: forbidden value of bit depth (should be 8 or 16 for color type 2)"; 
-          error_count++;
+          error() << "\n  Error: forbidden value of bit depth (should be 8 or 16 for color type 2)"; 
         }
         };
       } break;
       case 3 : {
         switch(bit_depth) {
         case 1 : case 2 : case 4 : case 8 : {
-          if(output) { cout << "Palette with " << (1 << bit_depth) << " colors"; }
+          if(output) { out << "Palette with " << (1 << bit_depth) << " colors"; }
         } break;
         default : {
-          cout << "\n  Error: forbidden bit depth (should be 1,2,4 or 8 for color type 3)";
-          error_count++;
+          error() << "\n  Error: forbidden bit depth (should be 1,2,4 or 8 for color type 3)";
         }
         };
       } break;
       case 4 : {
         switch(bit_depth) {
         case 8 : case 16 : {
-          if(output) { cout << "Monochrome with transparency with " << (1 << bit_depth) << " levels of gray and alpha"; }
+          if(output) { out << "Monochrome with transparency with " << (1 << bit_depth) << " levels of gray and alpha"; }
         } break;
         default : {
-          cout << "\n  Error: forbidden bit depth (should be 8 or 16 for color type 4)";
-          error_count++;
+          error() << "\n  Error: forbidden bit depth (should be 8 or 16 for color type 4)";
         }
         };
       } break;
       case 6 : {
         switch(bit_depth) {
         case 8 : case 16 : {
-          if(output) { cout << "TrueColor with transparency withn " << (1 << bit_depth) << " levels of R, G, B and alpha"; }
+          if(output) { out << "TrueColor with transparency withn " << (1 << bit_depth) << " levels of R, G, B and alpha"; }
         } break;
         default : {
-          cout << "\n  Error: forbidden bit depth (should be 8 or 16 for color type 6)";
-          error_count++;
+          error() << "\n  Error: forbidden bit depth (should be 8 or 16 for color type 6)";
         }
         };
       } break;
       default : {
-        cout << "Error: forbidden color type";
-        error_count++;
+        error() << "Error: forbidden color type";
       }
       };
-      if(output) cout << "\n";
+      if(output) out << "\n";
       
       if(!good_compression) {
-        cout << "Error: compression type unknown (only 0 is allowed in PNG 1.0 to 1.2)\n";
-        error_count++;
+        error() << "Error: compression type unknown (only 0 is allowed in PNG 1.0 to 1.2)\n";
       };
       if(!good_filter) {
-        cout << "Error: filter type unknown (only 0 is allowed in PNG 1.0 to 1.2)\n";
-        error_count++;
+        error() << "Error: filter type unknown (only 0 is allowed in PNG 1.0 to 1.2)\n";
       };
       switch(interlace) {
       case 0 : {
-          if(output) { cout << "  No interlace\n";}
+          if(output) { out << "  No interlace\n";}
       } break;
       case 1 : {
-        if(output) { cout << "  Interlace: Adam7\n"; }
+        if(output) { out << "  Interlace: Adam7\n"; }
       } break;
       default : {
-        cout << "Error: unknown interlace type (only 0 and 1 are allowed in PNG 1.0 to 1.2)\n";
-        error_count++;
+        error() << "Error: unknown interlace type (only 0 and 1 are allowed in PNG 1.0 to 1.2)\n";
       }
       };
     };
+
+    PngHeader header;
+    header.width = width;
+    header.height = height;
+    header.bit_depth = bit_depth;
+    header.color_type = color_type;
+    header.compression = compression;
+    header.filter = filter;
+    header.interlace = interlace;
+    visitor.on_header(header);
   };
 }
 
-void handlePalette(bool output) {
-  using std::cout;
+void Analysis::handlePalette(bool output) {
   if(header_met) {
     if((chunk_length % 3) != 0) {
-      cout << "Error: chuck size should be a multiple of 3\n";
-      error_count++;
+      error() << "Error: chuck size should be a multiple of 3\n";
     }
     else {
       palette_size =(int32_t)( ldiv(chunk_length,3).quot); // normally, length >0
-      if(output) { cout << "    number of entries = " << palette_size << "\n"; }
+      if(output) { out << "    number of entries = " << palette_size << "\n"; }
       if(color_type==2 || color_type==6) { // Suggested Palette
-        if(output) { cout << "    the suggested palette if the display is not TrueColor\n"; }
+        if(output) { out << "    the suggested palette if the display is not TrueColor\n"; }
         if(256 < palette_size ) {
-          cout << "Error: palette length should not exceed 256\n";
-          error_count++;
+          error() << "Error: palette length should not exceed 256\n";
         }
       }
       if(color_type==3) { // Palette (compulsory)
         if((1 << bit_depth) < palette_size) {
-          cout << "Error: palette length should not exceed what has been\n"
-               << "        declared in the Header\n";
-          error_count++;
+          error() << "Error: palette length should not exceed what has been\n"
+                   << "        declared in the Header\n";
         }
       }
     }
   }
 }
 
-void handleData() { // do nothing
+void Analysis::handleData(bool /*output*/) {
   total_idat_chunks++;
   total_idat_bytes += chunk_length;
+
+  // a chunk read by morsels (chunk_data null) was decompressed while read
+  if(chunk_data) feedImageData(chunk_data,chunk_length);
+}
+
+// option inflate
+
+void Analysis::feedImageData(const unsigned char *data, size_t len) {
+  if(!options.inflate || image_data_done) return;
+  PhaseTimer::Scope t(timer,PhaseTimer::INFLATE,len);
+  if(!image_data_started) {
+    image_data_started = true;
+    if(options.unfilter && header_met
+       && row_decoder.start(width,height,bit_depth,color_type,interlace,
+                            options.profile ? &profile : nullptr)) {
+      image_data.rows = &row_decoder;
+      if(options.profile) image_data.profile = &profile;
+    }
+  }
+  if(!image_data.feed(data,len)) {
+    error() << "Error: image data: " << image_data.message << "\n";
+  }
+}
+
+// called after the last IDAT chunk (option inflate)
+
+void Analysis::endImageData() {
+  image_data_done = true;
+  if(header_met) {
+    expected_data_bytes = imageDataSize(width,height,bit_depth,color_type,interlace);
+  }
+
+  if(!options.text_only) {
+    out << "- Image data stream: " << image_data.in_bytes << " bytes decompressed to "
+        << image_data.out_bytes << " bytes";
+    if(expected_data_bytes >= 0) out << " (the header implies " << expected_data_bytes << ")";
+    out << "\n";
+    if(row_decoder.active) {
+      const uint64_t *n = row_decoder.filter_counts;
+      out << "  Rows: " << row_decoder.rows << ", filter types: None " << n[0] << ", Sub " << n[1]
+          << ", Up " << n[2] << ", Average " << n[3] << ", Paeth " << n[4] << "\n";
+      if(row_decoder.passes.size() > 1) {
+        for(size_t p=0; p<row_decoder.passes.size(); p++) {
+          const RowDecoder::Pass &pass = row_decoder.passes[p];
+          n = pass.filter_counts;
+          out << "  Adam7 pass " << p+1 << ": " << pass.width << "x" << pass.height << " pixels";
+          if(pass.rows == 0) {
+            out << (pass.width && pass.height ? ", no data\n" : ", empty\n");
+            continue;
+          }
+          out << ", " << pass.rows << " rows of " << pass.row_size << " bytes (" << pass.rows*pass.row_size
+              << " bytes), filter types: None " << n[0]
+              << ", Sub " << n[1] << ", Up " << n[2] << ", Average " << n[3] << ", Paeth " << n[4] << "\n";
+        }
+      }
+    }
+    else if(options.unfilter) {
+      out << "  Rows not rebuilt (invalid header or rows too long)\n";
+    }
+    if(options.profile) outputProfile();
+    out << "\n";
+  }
+
+  if(row_decoder.invalid_filters) {
+    ErrorMessage e = error();
+    e << "Error: " << row_decoder.invalid_filters << " rows with an invalid filter type (the first one: ";
+    if(row_decoder.passes.size() > 1) e << "pass " << row_decoder.first_invalid_pass+1 << ", ";
+    e << "row " << row_decoder.first_invalid_row << ", type " << row_decoder.first_invalid_type << ")\n";
+  }
+
+  if(image_data.failed) return; // already reported
+  if(!image_data.ended) {
+    error() << "Error: image data truncated (the zlib stream is not finished)\n";
+  }
+  else if(expected_data_bytes >= 0 && (int64_t)image_data.out_bytes != expected_data_bytes) {
+    error() << "Error: decompressed image data size does not match the header ("
+            << image_data.out_bytes << " bytes instead of " << expected_data_bytes << ")\n";
+  }
+  if(image_data.extra_bytes) {
+    error() << "Error: " << image_data.extra_bytes << " bytes of image data after the end of the zlib stream\n";
+  }
+}
+
+// zlib header and compression of the rows, band by band (option profile)
+
+void Analysis::outputProfile() {
+  static const char *levels[] = {"fastest","fast","default","maximum"};
+  profile.finish(image_data.consumed());
+  if(image_data.zlib_header_len == 2) {
+    unsigned cmf = image_data.zlib_header[0], flg = image_data.zlib_header[1];
+    out << "  zlib header: ";
+    if((cmf & 15) == 8 && (cmf >> 4) <= 7)
+      out << "window " << (1 << ((cmf >> 4)+8)) << " bytes";
+    else
+      out << "compression method " << (cmf & 15) << ", info " << (cmf >> 4);
+    out << ", compression level " << (flg >> 6) << " (" << levels[flg >> 6] << ")"
+        << (flg & 0x20 ? ", preset dictionary" : "") << "\n";
+  }
+  for(const StreamProfile::Band &b : profile.bands) {
+    const uint64_t *n = b.filter_counts;
+    out << "  Rows " << b.first_row << "-" << b.first_row+b.rows-1 << ": "
+        << b.compressed_bytes << " / " << b.raw_bytes << " bytes";
+    if(b.raw_bytes) {
+      uint64_t permil = (b.compressed_bytes*1000+b.raw_bytes/2)/b.raw_bytes;
+      out << " (" << permil/10 << "." << permil%10 << "%)";
+    }
+    out << ", filter types: None " << n[0] << ", Sub " << n[1] << ", Up " << n[2]
+        << ", Average " << n[3] << ", Paeth " << n[4];
+    if(n[5]) out << ", invalid " << n[5];
+    out << "\n";
+  }
 }
 
-void handleEnd() {
+void Analysis::handleEnd(bool /*output*/) {
   end_chunk_met=true;
 }
 
-void handleBackground(bool output) {
-  using std::cout;
+void Analysis::handleBackground(bool output) {
   if(header_met) {
     switch(color_type) {
     case 3 : {
       unsigned char c;
       if(chunk_length!=1) {
-        cout << "Error: chunk size should be 1 for color mode 3";
-        error_count++;
+        error() << "Error: chunk size should be 1 for color mode 3";
       }
       else {
-        readNumber(1,c,false);
+        readNumber<1,false>(c);
         if(c < palette_size) {
-          if(output) { cout << "    Background color has index (in the palette) = " << c << "\n"; }
+          if(output) { out << "    Background color has index (in the palette) = " << c << "\n"; }
         }
         else {
-          cout << "Error: background color's index is out of the palette\n";
-          error_count++;
+          error() << "Error: background color's index is out of the palette\n";
         }
       }
     } break;
     case 0 : case 4 : {
       uint16_t c;
       if(chunk_length!=2) {
-        cout << "Error: chunk size should be 2 for color modes 0 and 4";
-        error_count++;
+        error() << "Error: chunk size should be 2 for color modes 0 and 4";
       }
       else {
-        readNumber(2,c,false);
+        readNumber<2,false>(c);
         if(c < (1 << bit_depth)) {
-          if(output) { cout << "    Background Intensity = " << c << "\n"; }
+          if(output) { out << "    Background Intensity = " << c << "\n"; }
         }
         else {
-          cout << "Error: background intensity is over the maximum\n";
-          error_count++;
+          error() << "Error: background intensity is over the maximum\n";
         }
       }
     } break;
     case 2 : case 6 : {
       uint16_t cR,cG,cB;
       if(chunk_length!=6) {
-        cout << "Error: chunk size should be 6 for color modes 2 and 6";
-        error_count++;
+        error() << "Error: chunk size should be 6 for color modes 2 and 6";
       }
       else {
-        readNumber(2,cR,false);
-        readNumber(2,cG,false);
-        readNumber(2,cB,false);
+        readNumber<2,false>(cR);
+        readNumber<2,false>(cG);
+        readNumber<2,false>(cB);
         if(cR < (1 << bit_depth) && cG < (1 << bit_depth) && cB < (1 << bit_depth)) {
-          if(output) { cout << "    RGB values of background = " << cR << "," << cG << "," << cB << "\n"; }
+          if(output) { out << "    RGB values of background = " << cR << "," << cG << "," << cB << "\n"; }
         }
         else {
-          cout << "Error: RGB values of background over bit_depth\n";
-          error_count++;
+          error() << "Error: RGB values of background over bit_depth\n";
         }
       }
     } break;
     default : {
-      cout << "Error: meaning of background color depends on color type, which has a forbidden value\n";
-      error_count++;
+      error() << "Error: meaning of background color depends on color type, which has a forbidden value\n";
     }
     };
   }
   else {
-    cout << "Error: meaning of background color depends on color type, which is undefined\n";
-    error_count++;
+    error() << "Error: meaning of background color depends on color type, which is undefined\n";
   }
 }
 
-void handleChroma(bool output) {
-  using std::cout;
+void Analysis::handleChroma(bool output) {
   if(chunk_length!=32) {
-    cout << "Error: chromaticity chunk length should be 32 bytes\n";
-    error_count++;
+    error() << "Error: chromaticity chunk length should be 32 bytes\n";
   }
   else {
     typedef long double MYREAL;
     double auxf;
     uint32_t a;
-    readNumber(4,a,false); auxf = ((MYREAL) a)/((MYREAL) 100000L);
-    if(output) { cout << "    White Point x = " << auxf << "\n"; }
-    readNumber(4,a,false); auxf = ((MYREAL) a)/((MYREAL) 100000L);
-    if(output) { cout << "    White Point y = " << auxf << "\n"; }
-    readNumber(4,a,false); auxf = ((MYREAL) a)/((MYREAL) 100000L);
-    if(output) { cout << "    Red Point x = " << auxf << "\n"; }
-    readNumber(4,a,false); auxf = ((MYREAL) a)/((MYREAL) 100000L);
-    if(output) { cout << "    Red Point y = " << auxf << "\n"; }
-    readNumber(4,a,false); auxf = ((MYREAL) a)/((MYREAL) 100000L);
-    if(output) { cout << "    Green Point x = " << auxf << "\n"; }
-    readNumber(4,a,false); auxf = ((MYREAL) a)/((MYREAL) 100000L);
-    if(output) { cout << "    Green Point y = " << auxf << "\n"; }
-    readNumber(4,a,false); auxf = ((MYREAL) a)/((MYREAL) 100000L);
-    if(output) { cout << "    Blue Point x = " << auxf << "\n"; }
-    readNumber(4,a,false); auxf = ((MYREAL) a)/((MYREAL) 100000L);
-    if(output) { cout << "    Blue Point y = " << auxf << "\n"; }
+    readNumber<4,false>(a); auxf = ((MYREAL) a)/((MYREAL) 100000L);
+    if(output) { out << "    White Point x = " << auxf << "\n"; }
+    readNumber<4,false>(a); auxf = ((MYREAL) a)/((MYREAL) 100000L);
+    if(output) { out << "    White Point y = " << auxf << "\n"; }
+    readNumber<4,false>(a); auxf = ((MYREAL) a)/((MYREAL) 100000L);
+    if(output) { out << "    Red Point x = " << auxf << "\n"; }
+    readNumber<4,false>(a); auxf = ((MYREAL) a)/((MYREAL) 100000L);
+    if(output) { out << "    Red Point y = " << auxf << "\n"; }
+    readNumber<4,false>(a); auxf = ((MYREAL) a)/((MYREAL) 100000L);
+    if(output) { out << "    Green Point x = " << auxf << "\n"; }
+    readNumber<4,false>(a); auxf = ((MYREAL) a)/((MYREAL) 100000L);
+    if(output) { out << "    Green Point y = " << auxf << "\n"; }
+    readNumber<4,false>(a); auxf = ((MYREAL) a)/((MYREAL) 100000L);
+    if(output) { out << "    Blue Point x = " << auxf << "\n"; }
+    readNumber<4,false>(a); auxf = ((MYREAL) a)/((MYREAL) 100000L);
+    if(output) { out << "    Blue Point y = " << auxf << "\n"; }
   }
 }
 
-void handleGamma(bool output) {
-  using std::cout;
+void Analysis::handleGamma(bool output) {
   if(chunk_length!=4) {
-    cout << "Error: GAMMA chunk length should be 4 bytes\n";
-    error_count++;
+    error() << "Error: GAMMA chunk length should be 4 bytes\n";
   }
   else {
     float gamma;
     uint32_t a;
-    readNumber(4,a,false);
+    readNumber<4,false>(a);
     gamma = ((float) a)/((float) 100000L);
-    if(output) { cout << "    Gamma = " << gamma << "\n"; }
+    if(output) { out << "    Gamma = " << gamma << "\n"; }
   }
 }
 
-void handleHistogram(bool output) {
-  using std::cout;
+void Analysis::handleHistogram(bool /*output*/) {
   if(palette_met) {
     if(chunk_length != 2*palette_size) {
-      cout << "Error: histogram should have same number of entries as the palette\n";
-      error_count++;
+      error() << "Error: histogram should have same number of entries as the palette\n";
     }
   }
 }
 
-void handlePixel(bool output) {
-  using std::cout;
+void Analysis::handlePixel(bool output) {
   if(chunk_length!=9) {
-    cout << "Error: this chunk should have 9 octets\n";
-    error_count++;
+    error() << "Error: this chunk should have 9 octets\n";
   }
   else {
     uint32_t a,b;
     unsigned char c;
-    readNumber(4,a,false);
-    readNumber(4,b,false);
-    readNumber(1,c,false);
-    if(output) { cout << "    X: " << a << " dots per unit"; }
+    readNumber<4,false>(a);
+    readNumber<4,false>(b);
+    readNumber<1,false>(c);
+    if(output) { out << "    X: " << a << " dots per unit"; }
     if(c==1) {
-      if(output) { cout << " (meaning " << 0.0254*((float) a) << "dpi)"; }
+      if(output) { out << " (meaning " << 0.0254*((float) a) << "dpi)"; }
     }
-    if(output) { cout << "\n"; }
-    if(output) { cout << "    Y: " << b << " dots per unit" ; }
+    if(output) { out << "\n"; }
+    if(output) { out << "    Y: " << b << " dots per unit" ; }
     if(c==1) {
-      if(output) { cout << " (meaning " << 0.0254*((float) b) << "dpi)"; }
+      if(output) { out << " (meaning " << 0.0254*((float) b) << "dpi)"; }
     }
-    if(output) { cout << "\n"; }
-    if(output) { cout << "    Unit specifier " << (int) c ; }
+    if(output) { out << "\n"; }
+    if(output) { out << "    Unit specifier " << (int) c ; }
     switch(c) {
     case 0 : {
-      if(output) { cout << " (no unit)\n"; }
+      if(output) { out << " (no unit)\n"; }
     } break;
     case 1 : {
-      if(output) { cout << " (meter)\n"; }
+      if(output) { out << " (meter)\n"; }
     } break;
     default : {
-      cout << "\n" << "Error: unit specifier should be 0 or 1\n";
-      error_count++;
+      error() << "\n" << "Error: unit specifier should be 0 or 1\n";
     }
     }
   }
 }
 
-void handleBits(bool output) {
-  using std::cout;
-  if(output) { cout << "    Significant bits of original data: "; }
+void Analysis::handleBits(bool output) {
+  if(output) { out << "    Significant bits of original data: "; }
   uint16_t red,green,blue,gray,alpha;
   switch(color_type) {
   case 0 : {
     if(chunk_length!=1) {
-      cout << "Error: in color mode 0, this chunk should be 1 byte long";
-      error_count++;
+      error() << "Error: in color mode 0, this chunk should be 1 byte long";
       return;
     }
-    readNumber(1,gray,false);
-    if(output) { cout << gray << "\n"; }
+    readNumber<1,false>(gray);
+    if(output) { out << gray << "\n"; }
     if(gray==0 || gray>bit_depth) {
-      cout << "Error: should be > 0 and at most equal to the bit depth";
-      error_count++;
+      error() << "Error: should be > 0 and at most equal to the bit depth";
     }
   } break;
   case 2 : case 3 : {
-    if(chunk_length!=1) {
-      cout << "Error: in color modes 2 and 3, this chunk should be 3 bytes long";
-      error_count++;
+    if(chunk_length!=3) {
+      error() << "Error: in color modes 2 and 3, this chunk should be 3 bytes long";
       return;
     }
-    readNumber(1,red,false);
-    readNumber(1,green,false);
-    readNumber(1,blue,false);
-    if(output) { cout << "red=" << red << ", green=" << green << ", blue=" << blue << "\n"; }
+    readNumber<1,false>(red);
+    readNumber<1,false>(green);
+    readNumber<1,false>(blue);
+    if(output) { out << "red=" << red << ", green=" << green << ", blue=" << blue << "\n"; }
     if(red==0 || red>bit_depth || green==0 || green>bit_depth || blue==0 || blue>bit_depth) {
-      cout << "Error: values should be > 0 and at most equal to the bit depth";
-      error_count++;
+      error() << "Error: values should be > 0 and at most equal to the bit depth";
     }
   } break;
   case 4 : {
     if(chunk_length!=2) {
-      cout << "Error: in color mode 4, this chunk should be 2 bytes long";
-      error_count++;
+      error() << "Error: in color mode 4, this chunk should be 2 bytes long";
       return;
     }
-    readNumber(1,gray,false);
-    readNumber(1,alpha,false);
-    if(output) { cout << "gray=" << gray << ", alpha=" << alpha << "\n"; }
+    readNumber<1,false>(gray);
+    readNumber<1,false>(alpha);
+    if(output) { out << "gray=" << gray << ", alpha=" << alpha << "\n"; }
     if(gray==0 || gray>bit_depth || alpha==0 || alpha>bit_depth) {
-      cout << "Error: values should be > 0 and at most equal to the bit depth";
-      error_count++;
+      error() << "Error: values should be > 0 and at most equal to the bit depth";
     }
   } break;
   case 6 : {
     if(chunk_length!=4) {
-      cout << "Error: in color mode 6, this chunk should be 4 bytes long";
-      error_count++;
+      error() << "Error: in color mode 6, this chunk should be 4 bytes long";
       return;
     }
-    readNumber(1,red,false);
-    readNumber(1,green,false);
-    readNumber(1,blue,false);
-    readNumber(1,alpha,false);
-    if(output) { cout << "red=" << red << ", green=" << green << ", blue=" << blue 
+    readNumber<1,false>(red);
+    readNumber<1,false>(green);
+    readNumber<1,false>(blue);
+    readNumber<1,false>(alpha);
+    if(output) { out << "red=" << red << ", green=" << green << ", blue=" << blue 
          << ", alpha=" << alpha << "\n"; }
     if(red==0 || red>bit_depth || green==0 || green>bit_depth ||
        blue==0 || blue>bit_depth || alpha==0 || alpha>bit_depth ) {
-      cout << "Error: values should be > 0 and at most equal to the bit depth";
-      error_count++;
+      error() << "Error: values should be > 0 and at most equal to the bit depth";
     }
   } break;
-    default : cout << "depends on colortype which is wrong\n";
+    default : out << "depends on colortype which is wrong\n";
   }
 }
 
-void handleTime(bool output) {
-  using std::cout;
+void Analysis::handleTime(bool output) {
   if(chunk_length!=7) {
-    cout << "Error: this chunk should be 7 bytes long\n";
-    error_count++;
+    error() << "Error: this chunk should be 7 bytes long\n";
   }
   else {
     uint16_t year;
     unsigned char month, day, hour, minute, second;
-    readNumber(2,year,false);
-    readNumber(1,month,false);
-    readNumber(1,day,false);
-    readNumber(1,hour,false);
-    readNumber(1,minute,false);
-    readNumber(1,second,false);
-    if(output) { cout << "    Last modification:" 
+    readNumber<2,false>(year);
+    readNumber<1,false>(month);
+    readNumber<1,false>(day);
+    readNumber<1,false>(hour);
+    readNumber<1,false>(minute);
+    readNumber<1,false>(second);
+    if(output) { out << "    Last modification:" 
          << " time: "  << (int)hour << "h:" << (int)minute << "mn:" << (int)second << "s"
          << " date: " << (int)day << "/" << (int)month << "/" << year
          << "\n"; }
@@ -569,169 +647,162 @@ void handleTime(bool output) {
   }
 }
 
-void handleTransparency(bool output) {
-  using std::cout;
+void Analysis::handleTransparency(bool output) {
   if(color_type==3) {
-    if(output) { cout << "    in color mode 3, this chunk contains an array of\n"
+    if(output) { out << "    in color mode 3, this chunk contains an array of\n"
          << "    alpha values corresponding to palette entries\n";
-    cout << "    entries: " << chunk_length; }
+    out << "    entries: " << chunk_length; }
     if(palette_met) {   
       if(chunk_length>palette_size) {
-        cout << "Error: more entries than the palette\n";
-        error_count++;
+        error() << "Error: more entries than the palette\n";
       }
     }
     else {
-      cout << "Error: this chunk should occur before palette chunk\n";
-      error_count++;
+      error() << "Error: this chunk should occur before palette chunk\n";
     }
     return;
   }
   if(color_type==0) {
     if(chunk_length!=2) {
-      cout << "Error: chunk should be 2 bytes long\n";
-      error_count++;
+      error() << "Error: chunk should be 2 bytes long\n";
     } else {
       uint16_t index;
-      readNumber(2,index,false);
-      if(output) { cout << "    in color mode 0, this chunk contains the gray level of\n"
+      readNumber<2,false>(index);
+      if(output) { out << "    in color mode 0, this chunk contains the gray level of\n"
            << "    the only transparent color: " << index << "\n"; }
       if(index >= (1 << bit_depth) ) {
-        cout << "Error: index too big for given bit depth (max="
-             << ((1 << bit_depth) -1) << ")\n";
-        error_count++;
+        error() << "Error: index too big for given bit depth (max="
+                 << ((1 << bit_depth) -1) << ")\n";
       }
     }
     return;
   }
   if(color_type==2) {
     if(chunk_length!=6) {
-      cout << "Error: chunk should be 6 bytes long\n";
-      error_count++;
+      error() << "Error: chunk should be 6 bytes long\n";
     } else {
       uint16_t ir,ig,ib,mx;
-      readNumber(2,ir,false);
-      readNumber(2,ig,false);
-      readNumber(2,ib,false);
-      if(output) { cout << "    in color mode 0, this chunk contains the RGB values of\n"
+      readNumber<2,false>(ir);
+      readNumber<2,false>(ig);
+      readNumber<2,false>(ib);
+      if(output) { out << "    in color mode 0, this chunk contains the RGB values of\n"
            << "    the only transparent color: "; 
-      cout << ir << ", " << ig << ", " << ib << "\n"; }
+      out << ir << ", " << ig << ", " << ib << "\n"; }
       mx=ir;
       mx=std::max(mx,ig);
       mx=std::max(mx,ib);
       if(mx >= (1 << bit_depth)) {
-        cout << "Error: value too big for given bit depth (max="
-             << ((1 << bit_depth) -1) << ")\n";
-        error_count++;
+        error() << "Error: value too big for given bit depth (max="
+                 << ((1 << bit_depth) -1) << ")\n";
       }
     }
     return;
   }
-  cout << "Error: this chunk is forbidden in color modes other than 0,2,3\n";
-  error_count++;
+  error() << "Error: this chunk is forbidden in color modes other than 0,2,3\n";
 }
 
-void handleText(bool output) {
+void Analysis::handleText(bool output) {
   total_text_chunks++;
-  using std::cout;
   
-  cout << "    Textual data, latin-1 encoded.\n";
+  out << "    Textual data, latin-1 encoded.\n";
 
   if(!readKeyword("    Keyword: \"",output)) return;
 
+  PngText text;
+  text.chunk = TEXT;
+  text.keyword = keyword;
+  text.decoded = output;
   if(output) {
-    cout << "    Text: \"";
-    chunkStreamInit();
-    for( ; !chunk_stream_finished; ) {
-      int32_t len=chunkReadMorsel();
-      cout << latin1_to_utf8(chunk_data,len);
-      cout << "\"\n";
-    }
+    latin1_to_utf8(chunk_data+chunk_pos,chunk_length-chunk_pos,text.text);
+    out << "    Text: \"";
+    out.write(text.text.data(),text.text.size());
+    out << "\"\n";
   }
+  visitor.on_text(text);
 }
 
-void handleZtext(bool output) {
+void Analysis::handleZtext(bool output) {
   total_text_chunks++;
-  using std::cout;
 
-  cout << "    Compressed textual data, latin-1 encoded.\n";
+  out << "    Compressed textual data, latin-1 encoded.\n";
 
   if(!readKeyword("    Keyword: \"",output)) return;
 
   unsigned char method;
-  readNumber(1,method,false);
+  readNumber<1,false>(method);
   
+  PngText text;
+  text.chunk = ZTEXT;
+  text.keyword = keyword;
+  text.decoded = false;
   if(output) {
-    cout << "    Compression method (should be 0=zlib): " << (int)method << "\n";
+    out << "    Compression method (should be 0=zlib): " << (int)method << "\n";
 
     if((int)method == 0) {
-      // buffer the whole chunk remaider in memory
-      std::streamoff len = chunk_length-(ifs.tellg()-chunk_start);
-      auto mx=std::numeric_limits<size_t>::max();
-      if((size_t)len <= mx) {
-        chunk_data.resize(len);
-        if(!ifs.read(chunk_data.data(),len)) call_err();
-        output_ztext(chunk_data.data(),len,"    Text: \"","\"\n",true);
-      } 
-      else {
-        cout << "    Sorry, this program is not designed to uncompress zlib data bigger than " << mx << "\n";
-      }
+      // the whole chunk is already in memory
+      output_ztext(chunk_data+chunk_pos,chunk_length-chunk_pos,"    Text: \"","\"\n",true,out,&text.text);
+      text.decoded = true;
     }
     else {
-      cout << "Error: compression method " << (int)method <<" not supported by PNG specification 1.0 to 1.2. Either the file PNG version is beyond the version supported by this program (1.2) or there is a problem with the file.\n";
-      error_count++;
+      error() << "Error: compression method " << (int)method <<" not supported by PNG specification 1.0 to 1.2. Either the file PNG version is beyond the version supported by this program (1.2) or there is a problem with the file.\n";
     }
   }
+  visitor.on_text(text);
+}
+
+// iTXt: the language tag, translated keyword and text must be valid utf-8
+
+void Analysis::reportUtf8(Utf8Validator &v, const char *what) {
+  if(!v.finish()) {
+    error() << "Error: " << what << " is not valid utf-8 (invalid sequence at byte " << v.error_offset << ")\n";
+  }
+}
+
+void Analysis::checkUtf8(const unsigned char *text, size_t len, const char *what) {
+  Utf8Validator v;
+  v.feed(text,len);
+  reportUtf8(v,what);
 }
 
-void handleItext(bool output) {
+void Analysis::handleItext(bool output) {
   total_text_chunks++;
-  using std::cout;
 
-  cout << "    International textual data, utf-8 encoded.\n";
+  out << "    International textual data, utf-8 encoded.\n";
 
   if(!readKeyword("    Keyword: \"",output)) return;
 
   unsigned char compressed;
-  readNumber(1,compressed,false);
-  if(output) { cout << "    Compressed? " << (int)compressed << ((int)compressed == 0 ? " (no)" : (int)compressed ==1 ? " (yes)" : " (invalid value)") << "\n"; }
+  readNumber<1,false>(compressed);
+  if(output) { out << "    Compressed? " << (int)compressed << ((int)compressed == 0 ? " (no)" : (int)compressed ==1 ? " (yes)" : " (invalid value)") << "\n"; }
   if(!((int)compressed ==0 || (int)compressed==1)) {
-    cout << "Error: invalid Compression flag value";
-    error_count++;
+    error() << "Error: invalid Compression flag value";
     return;
   }
 
   unsigned char method;
-  readNumber(1,method,false);
-  if(output) { cout << "    Compression method (should be 0" << ((int)compressed==1 ? "zlib" : "") << "): " << (int)method << "\n"; }
-
-  // buffer the whole chunk remainder in memory
-  std::streamoff po = ifs.tellg()-chunk_start;
-  std::streamsize len = chunk_length-po;
-  chunk_data.resize(len);
-  if(!ifs.read(chunk_data.data(),len)) call_err();
+  readNumber<1,false>(method);
+  if(output) { out << "    Compression method (should be 0" << ((int)compressed==1 ? "zlib" : "") << "): " << (int)method << "\n"; }
 
+  // the whole chunk is already in memory
   bool null_found;
 
   null_found=false;
-  int32_t po2 = 0;
+  int32_t po2 = chunk_pos;
   for( ; po2<chunk_length && !null_found; po2++) {
     null_found = chunk_data[po2]==0;
   }
   if(!null_found) {
-    cout << "Error: no null-terminating character found for the language tag\n";
-    error_count++;
+    error() << "Error: no null-terminating character found for the language tag\n";
     return;
   }
   if(output) {
-    if(po2-1>0) {
-      cout << "    Language tag: \"";
-      for(int32_t i=0; i<po2-1; i++)
-        cout << chunk_data[i];
-      cout << "\"\n";
+    if(po2-1>chunk_pos) {
+      out << "    Language tag: \"";
+      out.write((const char *)chunk_data+chunk_pos,po2-1-chunk_pos);
+      out << "\"\n";
     }
     else {
-      cout << "    No language tag\n";
+      out << "    No language tag\n";
     }
   }
 
@@ -741,107 +812,110 @@ void handleItext(bool output) {
     null_found = chunk_data[po3]==0;
   }
   if(!null_found) {
-    cout << "Error: no null-terminating character found for the translated keyword\n";
-    error_count++;
+    error() << "Error: no null-terminating character found for the translated keyword\n";
     return;
   }
+  checkUtf8(chunk_data+chunk_pos,po2-1-chunk_pos,"language tag");
+  checkUtf8(chunk_data+po2,po3-1-po2,"translated keyword");
+
+  PngText text;
+  text.chunk = INTERNATIONAL;
+  text.keyword = keyword;
+  text.language.assign((const char *)chunk_data+chunk_pos,po2-1-chunk_pos);
+  text.translated_keyword.assign((const char *)chunk_data+po2,po3-1-po2);
+  text.decoded = false;
+
   if(output) { 
     if(po3-1>po2) {
-      cout << "    Translated keyword: \"";
-      for(int32_t i=po2; i<po3-1; i++)
-        cout << chunk_data[i];
-      cout << "\"\n";
+      out << "    Translated keyword: \"";
+      out.write((const char *)chunk_data+po2,po3-1-po2);
+      out << "\"\n";
     }
     else {
-      cout << "    No translated keyword\n";
+      out << "    No translated keyword\n";
     }
   }
 
   if(compressed) {
     if((int)method==0) {
+      // the text is checked even when it is not shown
+      Utf8Validator utf8;
       if(output) {
-        auto mx=std::numeric_limits<size_t>::max();
-        if((size_t)len <= mx)
-          output_ztext(&chunk_data[po3],len-po3,"    Text: \"","\"\n",false);
-        else
-          cout << "    Sorry, this program is not designed to uncompress zlib data bigger than " << mx << "\n";
+        output_ztext(&chunk_data[po3],chunk_length-po3,"    Text: \"","\"\n",false,out,&text.text,&utf8);
+        text.decoded = true;
       }
+      else {
+        std::ostream discard(nullptr);
+        output_ztext(&chunk_data[po3],chunk_length-po3,"","",false,discard,nullptr,&utf8);
+      }
+      reportUtf8(utf8,"decompressed text");
     }
     else {
-      cout << "Error: compression method " << (int)method <<" not supported by PNG specification 1.0 to 1.2. Either the file PNG version is beyond the version supported by this program (1.2) or there is a problem with the file.\n";
-      error_count++;
+      error() << "Error: compression method " << (int)method <<" not supported by PNG specification 1.0 to 1.2. Either the file PNG version is beyond the version supported by this program (1.2) or there is a problem with the file.\n";
     }
   }
   else {
     if(output) {
-      cout << "    Text: \"";
-      for(std::streamsize i=po3; i<len; i++)
-        cout << chunk_data[i]; // inefficient?
-      cout << "\"\n";
+      text.text.assign((const char *)chunk_data+po3,chunk_length-po3);
+      text.decoded = true;
+      out << "    Text: \"";
+      out.write((const char *)chunk_data+po3,chunk_length-po3);
+      out << "\"\n";
     }
+    checkUtf8(chunk_data+po3,chunk_length-po3,"text");
   }
+  visitor.on_text(text);
 }
 
-void handleICCP(bool output) {
-  using std::cout;
+void Analysis::handleICCP(bool output) {
 
-  cout << "    Embedded International Color Consortium profile.\n";
+  out << "    Embedded International Color Consortium profile.\n";
 
   if(!readKeyword("    Profile name: \"",output)) return;
 
   unsigned char method;
-  readNumber(1,method,false);
+  readNumber<1,false>(method);
   
   if(output) {
-    cout << "    Compression method (must be 0=zlib): " << (int)method << "\n";
+    out << "    Compression method (must be 0=zlib): " << (int)method << "\n";
   }
 
-  if(!dump_icc) {
-    cout << "    To dump the ICC to a file, please use option -icc.\n" ;
+  if(!options.icc) {
+    out << "    To dump the ICC to a file, please use option -icc.\n" ;
   }
   else {
-    // buffer the whole chunk remainder in memory
-    std::streamoff po = ifs.tellg()-chunk_start;
-    std::streamsize len = chunk_length-po;
-    chunk_data.resize(len);
-    if(!ifs.read(chunk_data.data(),len)) call_err();
-
-    output_ztext(chunk_data.data(),len,"","",false,icc_fs);
+    // the whole chunk is already in memory
+    output_ztext(chunk_data+chunk_pos,chunk_length-chunk_pos,"","",false,*options.icc);
   }
 }
 
-void handleSRGB(bool output) {
-  using std::cout;
+void Analysis::handleSRGB(bool output) {
 
   if(chunk_length!=1) {
-    cout << "Error: should be 1 byte long\n";
-    error_count++;
+    error() << "Error: should be 1 byte long\n";
   }
   else {
     unsigned char ri;
-    readNumber(1,ri,false);
-    if(output) { cout << "    Rendering intent = " << (int)ri << "\n"; }
+    readNumber<1,false>(ri);
+    if(output) { out << "    Rendering intent = " << (int)ri << "\n"; }
     if(ri>3) {
-      cout << "Error: value has no meaning\n";
-      error_count++;
+      error() << "Error: value has no meaning\n";
     }
     else {
-      if(output) { cout << "    meaning: ";
+      if(output) { out << "    meaning: ";
       switch(ri) {
-      case 0 : cout << "Perceputal\n"; break;
-      case 1 : cout << "Relative colorimetric\n"; break;
-      case 2 : cout << "Saturation\n"; break;
-      case 3 : cout << "Absolute colorimetric\n"; break;
+      case 0 : out << "Perceputal\n"; break;
+      case 1 : out << "Relative colorimetric\n"; break;
+      case 2 : out << "Saturation\n"; break;
+      case 3 : out << "Absolute colorimetric\n"; break;
       } }
     }
   }
 }
 
-void handleUnknown(bool output) {
-  using std::cout;
+void Analysis::handleUnknown(bool /*output*/) {
 
-  cout << "Error: chunk name unknown\n";
-  error_count++;
+  error() << "Error: chunk name unknown\n";
   bool is_name=true;
   bool a[4];
   for(int i=0; i<4; i++) {
@@ -858,67 +932,190 @@ void handleUnknown(bool output) {
     }
   }
   if(is_name) {
-    cout << "  Analysis of the name: this chunk is " << (a[0] ? "Critical" : "Ancillary" )
+    out << "  Analysis of the name: this chunk is " << (a[0] ? "Critical" : "Ancillary" )
          << " , "       << (a[1] ? "public" : "private" )
          << " , 3rd letter should be uppercase and is: " << (a[2] ? "Uppercase" : "Lowercase" )
          << " , "       << (a[3] ? "unsafe to copy" : "safe to copy" )
          << "\n";
   }
   else {
-    cout << "Error: not a valid name\n";
-    error_count++;
+    error() << "Error: not a valid name\n";
   }
 }
 
 
 // Checks whether the order of chunks is correct
 
-void checkOrder() {
-  using std::cout;
+// Chunk types known by the program
+//
+// For each type: the handler, the ordering rule and which option controls
+// the output. Adding a chunk type is adding a line here.
+
+// ordering rules
+enum {
+  ORDER_AFTER_HEADER  = 1,
+  ORDER_BEFORE_PLTE   = 2,
+  ORDER_AFTER_PLTE    = 4,   // the palette is compulsory before
+  ORDER_AFTER_PLTE_IF = 8,   // after the palette, if there is one
+  ORDER_BEFORE_IDAT   = 16
+};
+
+// output flags
+enum {
+  SHOW_REPORT  = 1,   // output unless option -t
+  SHOW_TEXT    = 2,   // output unless option -x
+  SHOW_IDAT    = 4    // the chunk line is hidden by option -n
+};
+
+struct ChunkType {
+  uint32_t id;
+  void (Analysis::*handler)(bool output); // nullptr: nothing to do
+  bool Analysis::*met;    // set when the chunk is met, if it must be unique (ordering rule)
+  int order;              // ORDER_* flags
+  int flags;              // SHOW_* flags
+  const char *several;    // ordering error messages
+  const char *misplaced;
+};
+
+constexpr ChunkType chunk_types[] = {
+  // Critical (IHDR and IDAT have special ordering rules, see checkOrder)
+  { fourcc(HEADER),        &Analysis::handleHeader,       nullptr, 0, SHOW_REPORT, nullptr, nullptr },
+  { fourcc(PALETTE),       &Analysis::handlePalette,      &Analysis::palette_met, 0, SHOW_REPORT,
+    "several palettes", nullptr },
+  { fourcc(DATA),          &Analysis::handleData,         nullptr, 0, SHOW_IDAT, nullptr, nullptr },
+  { fourcc(END),           &Analysis::handleEnd,          nullptr, 0, 0, nullptr, nullptr },
+  // Ancillary
+  // v1.0
+  { fourcc(BACKGROUND),    &Analysis::handleBackground,   &Analysis::background_met,
+    ORDER_AFTER_HEADER | ORDER_AFTER_PLTE_IF | ORDER_BEFORE_IDAT, SHOW_REPORT,
+    "background color defined several times",
+    "background color must be after the header,\n"
+    "        after the palette (if any), and before the data" },
+  { fourcc(CHROMA),        &Analysis::handleChroma,       &Analysis::chroma_met,
+    ORDER_AFTER_HEADER | ORDER_BEFORE_PLTE | ORDER_BEFORE_IDAT, SHOW_REPORT,
+    "chromaticity defined several times",
+    "chromaticity must be after the header,\n"
+    "        before the palette (if any), and before the data" },
+  { fourcc(GAMMA),         &Analysis::handleGamma,        &Analysis::gamma_met,
+    ORDER_AFTER_HEADER | ORDER_BEFORE_PLTE | ORDER_BEFORE_IDAT, SHOW_REPORT,
+    "gamma defined several times",
+    "GAMMA chunk must be after the header,\n"
+    "         before the palette (if any), and before the data" },
+  { fourcc(HISTOGRAM),     &Analysis::handleHistogram,    &Analysis::histogram_met,
+    ORDER_AFTER_HEADER | ORDER_AFTER_PLTE | ORDER_BEFORE_IDAT, SHOW_REPORT,
+    "histogram defined several times",
+    "histogramme must be after the palette and\n"
+    "        before the data" },
+  { fourcc(PIXEL),         &Analysis::handlePixel,        &Analysis::pixel_met,
+    ORDER_AFTER_HEADER | ORDER_BEFORE_IDAT, SHOW_REPORT,
+    "physical pixel chunk defined several times",
+    "physical pixel chunk must be after the header\n"
+    "        and before the data" },
+  { fourcc(BITS),          &Analysis::handleBits,         &Analysis::bits_met,
+    ORDER_AFTER_HEADER | ORDER_BEFORE_PLTE | ORDER_BEFORE_IDAT, SHOW_REPORT,
+    "significant bits chunk defined several times",
+    "significant bits chunk must be after the header,\n"
+    "        before the palette (if any) and before the data" },
+  { fourcc(TEXT),          &Analysis::handleText,         nullptr, 0, SHOW_TEXT, nullptr, nullptr },
+  { fourcc(TIME),          &Analysis::handleTime,         nullptr, 0, SHOW_REPORT, nullptr, nullptr },
+  { fourcc(TRANSPARENCY),  &Analysis::handleTransparency, &Analysis::transparency_met,
+    ORDER_AFTER_HEADER | ORDER_AFTER_PLTE_IF | ORDER_BEFORE_IDAT, SHOW_REPORT,
+    "transparency chunk defined several times",
+    "transparency chunk must be after the header,\n"
+    "        after the palette (if any) and before the data" },
+  { fourcc(ZTEXT),         &Analysis::handleZtext,        nullptr, 0, SHOW_TEXT, nullptr, nullptr },
+  // v1.1
+  { fourcc(EMBEDDED_ICC),  &Analysis::handleICCP,         nullptr, 0, SHOW_REPORT, nullptr, nullptr },
+  { fourcc(SUGGESTED_PAL), nullptr,                       nullptr, 0, 0, nullptr, nullptr },
+  { fourcc(SRGB),          &Analysis::handleSRGB,         nullptr, 0, SHOW_REPORT, nullptr, nullptr },
+  // v1.2
+  { fourcc(INTERNATIONAL), &Analysis::handleItext,        nullptr, 0, SHOW_TEXT, nullptr, nullptr },
+  // extension (not handled)
+  { fourcc(OFFSET),        &Analysis::handleNotHandled,   nullptr, 0, 0, nullptr, nullptr },
+  { fourcc(PIX_CAL),       &Analysis::handleNotHandled,   nullptr, 0, 0, nullptr, nullptr },
+  { fourcc(GIFGCE),        &Analysis::handleNotHandled,   nullptr, 0, 0, nullptr, nullptr },
+  { fourcc(GIFAE),         &Analysis::handleNotHandled,   nullptr, 0, 0, nullptr, nullptr },
+  { fourcc(FRACTAL),       &Analysis::handleNotHandled,   nullptr, 0, 0, nullptr, nullptr },
+  // deprecated
+  { fourcc(GIFTEXT),       &Analysis::handleDeprecated,   nullptr, 0, 0, nullptr, nullptr },
+};
+
+const int chunk_types_count = sizeof(chunk_types)/sizeof(chunk_types[0]);
+
+// Hash index on the chunk types (open addressing), built once
+
+class ChunkIndex {
+  static const int INDEX_BITS = 6;
+  unsigned char slots[1 << INDEX_BITS]; // 1 + index in chunk_types, 0 if free
+  static_assert(chunk_types_count < (1 << INDEX_BITS)/2, "chunk type index too small");
+
+  static uint32_t hash(uint32_t id) { return (id * 0x9e3779b1u) >> (32-INDEX_BITS); }
+
+public:
+  ChunkIndex() {
+    memset(slots,0,sizeof(slots));
+    for(int i=0; i<chunk_types_count; i++) {
+      uint32_t h = hash(chunk_types[i].id);
+      while(slots[h]) h = (h+1) & ((1 << INDEX_BITS)-1);
+      slots[h] = (unsigned char)(i+1);
+    }
+  }
+
+  const ChunkType *find(uint32_t id) const {
+    for(uint32_t h = hash(id); slots[h]; h = (h+1) & ((1 << INDEX_BITS)-1)) {
+      const ChunkType &t = chunk_types[slots[h]-1];
+      if(t.id == id) return &t;
+    }
+    return nullptr;
+  }
+};
+
+const ChunkType *findChunkType(uint32_t id) {
+  static const ChunkIndex index;
+  return index.find(id);
+}
+
+// whether the chunk placement respects the rule (ORDER_* flags)
+
+bool Analysis::placementOk(int order) {
+  return !((order & ORDER_AFTER_HEADER  && !header_met)
+        || (order & ORDER_BEFORE_PLTE   && palette_met)
+        || (order & ORDER_AFTER_PLTE    && !palette_met)
+        || (order & ORDER_AFTER_PLTE_IF && palette_used && !palette_met)
+        || (order & ORDER_BEFORE_IDAT   && data_met));
+}
+
+void Analysis::checkOrder() {
 
   if(first_chunk) {
     first_chunk=false;
     
-    if(strncmp(chunk_name,HEADER,4)!=0) {
-      cout << "ERROR: first chunk is not HEADER\n";
-      error_count++;
+    if(chunk_id != fourcc(HEADER)) {
+      error() << "ERROR: first chunk is not HEADER\n";
     }
     else {
       header_met=true;
     }
   }
   else {
-    if(strncmp(chunk_name,HEADER,4)==0) {
+    if(chunk_id == fourcc(HEADER)) {
       if(header_met) {
-        cout << "ERROR: several HEADER chunks\n";
-        error_count++;
+        error() << "ERROR: several HEADER chunks\n";
       }
       else {
-        cout << "ERROR: HEADER must be at the beginning\n";
-        error_count++;
+        error() << "ERROR: HEADER must be at the beginning\n";
         header_met=true;
       }
     }
   }
-  if(strncmp(chunk_name,PALETTE,4)==0) {
-    if(palette_met) {
-      cout << "ERROR: several palettes\n";
-      error_count++;
-    }
-    else {
-      palette_met=true;
-    }
-  }
-  if(strncmp(chunk_name,DATA,4)==0) {
+  if(chunk_id == fourcc(DATA)) {
     if(data_ended &! data_error) {
-      cout << "ERROR: DATA chunk should be contiguous\n";
-      error_count++;
+      error() << "ERROR: DATA chunk should be contiguous\n";
       data_error=true;
     }
     else {
       if(palette_used && !palette_met) {
-        cout << "ERROR: palette needed before beginning of data\n";
-        error_count++;
+        error() << "ERROR: palette needed before beginning of data\n";
       }
       data_met=true;
     }
@@ -928,154 +1125,41 @@ void checkOrder() {
       data_ended=true;
     }
   }
-  if(strncmp(chunk_name,BACKGROUND,4)==0) {
-    if(background_met) {
-      cout << "ERROR: background color defined several times\n";
-      error_count++;
-    }
-    else {
-      if(!(header_met && (palette_met || !palette_used) && !data_met)) {
-        cout << "ERROR: background color must be after the header,\n"
-             << "        after the palette (if any), and before the data\n";
-        error_count++;
-      }
-      background_met=true;
-    }
-  }
-  if(strncmp(chunk_name,GAMMA,4)==0) {
-    if(gamma_met) {
-      cout << "ERROR: gamma defined several times\n";
-      error_count++;
-    }
-    else {
-      if(!(header_met && !palette_met && !data_met)) {
-        cout << "ERROR: GAMMA chunk must be after the header,\n"
-             << "         before the palette (if any), and before the data\n";
-        error_count++;
-      }
-      gamma_met=true;
-    }
-  }
-  if(strncmp(chunk_name,CHROMA,4)==0) {
-    if(chroma_met) {
-      cout << "ERROR: chromaticity defined several times\n";
-      error_count++;
-    }
-    else {
-      if(!(header_met && !palette_met && !data_met)) {
-        cout << "ERROR: chromaticity must be after the header,\n"
-             << "        before the palette (if any), and before the data\n";
-        error_count++;
-      }
-      chroma_met=true;
-    }
-  }
-  if(strncmp(chunk_name,HISTOGRAM,4)==0) {
-    if(histogram_met) {
-      cout << "ERROR: histogram defined several times\n";
-      error_count++;
-    }
-    else {
-      if(!(header_met && palette_met && !data_met)) {
-        cout << "ERROR: histogramme must be after the palette and\n"
-             << "        before the data\n";
-        error_count++;
-      }
-      histogram_met=true;
-    }
-  }
-  if(strncmp(chunk_name,PIXEL,4)==0) {
-    if(pixel_met) {
-      cout << "ERROR: physical pixel chunk defined several times\n";
-      error_count++;
-    }
-    else {
-      if(!(header_met && !data_met)) {
-        cout << "ERROR: physical pixel chunk must be after the header\n"
-             << "        and before the data\n";
-        error_count++;
-      }
-      pixel_met=true;
-    }
-  }
-  if(strncmp(chunk_name,TRANSPARENCY,4)==0) {
-    if(transparency_met) {
-      cout << "ERROR: transparency chunk defined several times\n";
-      error_count++;
-    }
-    else {
-      if(!(header_met && (palette_met || !palette_used) && !data_met)) {
-        cout << "ERROR: transparency chunk must be after the header,\n"
-             << "        after the palette (if any) and before the data\n";
-        error_count++;
-      }
-      transparency_met=true;
-    }
-  }
-  if(strncmp(chunk_name,BITS,4)==0) {
-    if(bits_met) {
-      cout << "ERROR: significant bits chunk defined several times\n";
-      error_count++;
+  if(chunk_type && chunk_type->met) {
+    if(this->*chunk_type->met) {
+      error() << "ERROR: " << chunk_type->several << "\n";
     }
     else {
-      if(!(header_met && !palette_met && !data_met)) {
-        cout << "ERROR: significant bits chunk must be after the header,\n"
-             << "        before the palette (if any) and before the data\n";
-        error_count++;
+      if(chunk_type->misplaced && !placementOk(chunk_type->order)) {
+        error() << "ERROR: " << chunk_type->misplaced << "\n";
       }
-      bits_met=true;
+      this->*chunk_type->met=true;
     }
   }
 }
 
-// long and boring procedure to call the right procedure
-
-void handleChunk() {
-  using std::cout;
+void Analysis::handleNotHandled(bool /*output*/) {
+  out << "  This chunk type (registered in PNG extension 1.2.0),\n"
+       << "  is not handled in this program\n";
+}
 
-  // Critical
-  if(strncmp(chunk_name,HEADER,4)==0)        { handleHeader(!text_only); goto escape_pt; }
-  if(strncmp(chunk_name,PALETTE,4)==0)       { handlePalette(!text_only); goto escape_pt; }
-  if(strncmp(chunk_name,DATA,4)==0)          { handleData(); goto escape_pt; }
-  if(strncmp(chunk_name,END,4)==0)           { handleEnd(); goto escape_pt; }
-  // Ancillary
-  // v1.0
-  if(strncmp(chunk_name,BACKGROUND,4)==0)    { handleBackground(!text_only); goto escape_pt; }
-  if(strncmp(chunk_name,CHROMA,4)==0)        { handleChroma(!text_only); goto escape_pt; }
-  if(strncmp(chunk_name,GAMMA,4)==0)         { handleGamma(!text_only); goto escape_pt; }
-  if(strncmp(chunk_name,HISTOGRAM,4)==0)     { handleHistogram(!text_only); goto escape_pt; }
-  if(strncmp(chunk_name,PIXEL,4)==0)         { handlePixel(!text_only); goto escape_pt; }
-  if(strncmp(chunk_name,BITS,4)==0)          { handleBits(!text_only); goto escape_pt; }
-  if(strncmp(chunk_name,TEXT,4)==0)          { handleText(!no_text); goto escape_pt; }
-  if(strncmp(chunk_name,TIME,4)==0)          { handleTime(!text_only); goto escape_pt; }
-  if(strncmp(chunk_name,TRANSPARENCY,4)==0)  { handleTransparency(!text_only); goto escape_pt; }
-  if(strncmp(chunk_name,ZTEXT,4)==0)         { handleZtext(!no_text); goto escape_pt; }
-  // v1.1
-  if(strncmp(chunk_name,EMBEDDED_ICC,4)==0)  { handleICCP(!text_only); goto escape_pt; }
-  if(strncmp(chunk_name,SUGGESTED_PAL,4)==0) { goto escape_pt; }
-  if(strncmp(chunk_name,SRGB,4)==0)          { handleSRGB(!text_only); goto escape_pt; }
-  // v1.2
-  if(strncmp(chunk_name,INTERNATIONAL,4)==0) { handleItext(!no_text); goto escape_pt; }
-  // extension (not handled)
-  if(strncmp(chunk_name,OFFSET,4)==0)        { goto not_handled; }
-  if(strncmp(chunk_name,PIX_CAL,4)==0)       { goto not_handled; }
-  if(strncmp(chunk_name,GIFGCE,4)==0)        { goto not_handled; }
-  if(strncmp(chunk_name,GIFAE,4)==0)         { goto not_handled; }
-  if(strncmp(chunk_name,FRACTAL,4)==0)       { goto not_handled; }
-  // deprecated
-  if(strncmp(chunk_name,GIFTEXT,4)==0) {
-    cout << "Warning: this chunk type (GIF Plain Text Extension)\n"
-         << "          has been deprecated since version 1.1.0\n";
-    goto escape_pt;
-  }
+void Analysis::handleDeprecated(bool /*output*/) {
+  out << "Warning: this chunk type (GIF Plain Text Extension)\n"
+       << "          has been deprecated since version 1.1.0\n";
+}
 
-  // If the chunk name is unknown :
-  handleUnknown(!text_only); goto escape_pt;
+// calls the handler of the chunk type
 
- not_handled:
-  cout << "  This chunk type (registered in PNG extension 1.2.0),\n"
-       << "  is not handled in this program\n";
-  
- escape_pt: 
-  ;
+void Analysis::handleChunk() {
+  PhaseTimer::Scope t(timer,PhaseTimer::HANDLERS+(chunk_type ? chunk_type-chunk_types : chunk_types_count),
+                      chunk_length);
+  if(!chunk_type) {
+    // If the chunk name is unknown :
+    handleUnknown(!options.text_only);
+    return;
+  }
+  if(!chunk_type->handler) return;
+  bool output = (chunk_type->flags & SHOW_REPORT && !options.text_only)
+             || (chunk_type->flags & SHOW_TEXT && !options.no_text);
+  (this->*chunk_type->handler)(output);
 }
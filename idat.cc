@@ -0,0 +1,370 @@
+// Image data (IDAT chunks), options -z and -u
+//
+// Together, the IDAT chunks form a single zlib stream. It is inflated chunk
+// by chunk through one z_stream into a buffer of fixed size: the image is
+// never held in memory. The checks are those of zlib (format, Adler-32 of
+// the decompressed data) plus the size implied by the header.
+// With -u the rows are also rebuilt, which checks their filter types.
+
+// Size of the decompressed image data, as implied by the header
+
+// samples per pixel for each color type (0 for invalid color types)
+inline int channels(int color_type) {
+  switch(color_type) {
+  case 0 : return 1;
+  case 2 : return 3;
+  case 3 : return 1;
+  case 4 : return 2;
+  case 6 : return 4;
+  default : return 0;
+  }
+}
+
+// bytes of a row (without its filter type byte)
+inline uint64_t rowBytes(uint64_t width, int bits_per_pixel) {
+  return (width*bits_per_pixel+7)/8;
+}
+
+// Adam7 interlace: the 7 passes, each one an 8x8 grid pattern
+// (first column and row, spacing between columns and rows)
+
+const int adam7_x0[7] = { 0, 4, 0, 2, 0, 1, 0 };
+const int adam7_y0[7] = { 0, 0, 4, 0, 2, 0, 1 };
+const int adam7_dx[7] = { 8, 8, 4, 4, 2, 2, 1 };
+const int adam7_dy[7] = { 8, 8, 8, 4, 4, 2, 2 };
+
+// number of columns (or rows) of the image in a pass
+inline uint64_t adam7Size(uint64_t size, int start, int step) {
+  return size > (uint64_t)start ? (size-start+step-1)/step : 0;
+}
+
+// returns the number of bytes, filter bytes included, or -1 if the header is not valid
+int64_t imageDataSize(int32_t width, int32_t height, int bit_depth, int color_type, int interlace) {
+  int bpp = channels(color_type)*bit_depth;
+  if(width <= 0 || height <= 0 || bpp == 0 || interlace > 1) return -1;
+  if(interlace == 0) {
+    return (int64_t)height*(1+rowBytes(width,bpp));
+  }
+  int64_t size = 0;
+  for(int p=0; p<7; p++) {
+    uint64_t w = adam7Size(width,adam7_x0[p],adam7_dx[p]);
+    uint64_t h = adam7Size(height,adam7_y0[p],adam7_dy[p]);
+    if(w && h) size += h*(1+rowBytes(w,bpp)); // an empty pass has no filter bytes either
+  }
+  return size;
+}
+
+// Profile of the image data stream (option profile)
+//
+// The rows are grouped in bands (in the order of the data, so Adam7 passes
+// follow each other). For each band: the filter types of its rows and its
+// raw and compressed sizes. The compressed size is the input zlib consumed
+// while producing the band, so it is exact up to the few bytes zlib reads
+// ahead.
+
+class StreamProfile {
+  std::vector<std::pair<size_t,uint64_t> > runs; // (row size, rows), in the order of the data
+  std::vector<uint64_t> ends;   // raw bytes at the end of each band
+  uint64_t band_rows;           // rows per band
+  uint64_t rows_seen;
+  size_t   closed;              // bands whose compressed size is known
+  uint64_t last_in;             // compressed bytes at the end of the last closed band
+
+public:
+  static const int BANDS = 16;
+
+  struct Band {
+    uint64_t first_row, rows;
+    uint64_t raw_bytes, compressed_bytes;
+    uint64_t filter_counts[6];  // the last one: invalid filter types
+  };
+  std::vector<Band> bands;
+
+  StreamProfile() : band_rows(1), rows_seen(0), closed(0), last_in(0) {}
+
+  void addRows(size_t row_size, uint64_t count) {
+    if(count) runs.push_back(std::make_pair(row_size,count));
+  }
+
+  // cuts the rows in bands, once all the rows are added
+  void plan() {
+    uint64_t total = 0;
+    for(auto &run : runs) total += run.second;
+    if(total == 0) return;
+    band_rows = (total+BANDS-1)/BANDS;
+    uint64_t r = 0;
+    for(auto &run : runs) {
+      uint64_t left = run.second;
+      while(left) {
+        size_t b = (size_t)(r/band_rows);
+        if(b == bands.size()) {
+          Band band;
+          memset(&band,0,sizeof(band));
+          band.first_row = r;
+          bands.push_back(band);
+        }
+        uint64_t take = std::min(left,(b+1)*band_rows-r);
+        bands[b].rows += take;
+        bands[b].raw_bytes += take*run.first;
+        r += take;
+        left -= take;
+      }
+    }
+    uint64_t end = 0;
+    for(Band &b : bands) ends.push_back(end += b.raw_bytes);
+  }
+
+  void row(int type) {
+    size_t b = (size_t)(rows_seen++/band_rows);
+    if(b < bands.size()) bands[b].filter_counts[type > 4 ? 5 : type]++;
+  }
+
+  // raw bytes at the end of the current band (the inflate output stops there)
+  uint64_t nextEnd() const {
+    return closed < ends.size() ? ends[closed] : UINT64_MAX;
+  }
+
+  // out: raw bytes produced so far, in: compressed bytes consumed so far
+  void progress(uint64_t out, uint64_t in) {
+    while(closed < ends.size() && out >= ends[closed]) {
+      bands[closed++].compressed_bytes = in-last_in;
+      last_in = in;
+    }
+  }
+
+  // end of the stream: the rest of the input goes to the current band
+  void finish(uint64_t in) {
+    if(closed < bands.size()) {
+      bands[closed++].compressed_bytes = in-last_in;
+      last_in = in;
+    }
+    closed = bands.size();
+  }
+};
+
+// Rows of the image data (option unfilter)
+//
+// The rows are rebuilt (see filter.cc) as they come out of the zlib stream,
+// with only two rows in memory: the previous one and the current one.
+// Their filter types are checked and counted.
+// An interlaced image is a sequence of 7 smaller images (the Adam7 passes),
+// each one with its own rows; empty passes are not in the data at all.
+
+class RowDecoder {
+  std::vector<unsigned char> prev, cur; // filter type byte, then the row
+  unsigned bpp;          // bytes per pixel for the filters (at least 1)
+  int bits;              // bits per pixel
+  size_t fill;           // bytes of the current row received
+
+public:
+  static const uint64_t MAX_ROW = 1 << 28; // longer rows are not rebuilt
+
+  struct Pass {
+    uint64_t width, height;     // in pixels
+    size_t   row_size;          // filter type byte included
+    uint64_t rows;              // rows received
+    uint64_t filter_counts[5];  // rows by filter type
+  };
+  std::vector<Pass> passes;     // one for a non interlaced image, 7 for Adam7
+  size_t pass;                  // current pass
+
+  StreamProfile *profile;       // receives the filter types, if not null
+  bool active;
+  uint64_t rows;                // rows rebuilt (all passes)
+  uint64_t filter_counts[5];    // rows by filter type (all passes)
+  uint64_t invalid_filters;     // rows with an invalid filter type (left as they are)
+  uint64_t first_invalid_row;   // in its pass
+  int      first_invalid_pass;
+  int      first_invalid_type;
+
+  RowDecoder() : bpp(1), bits(0), fill(0), pass(0), profile(nullptr), active(false), rows(0), invalid_filters(0),
+                 first_invalid_row(0), first_invalid_pass(0), first_invalid_type(0) {
+    for(int i=0; i<5; i++) filter_counts[i] = 0;
+  }
+
+  // returns false if the rows cannot be rebuilt (invalid header, rows too long)
+  // the profile, if any, gets the geometry of the rows
+  bool start(int32_t width, int32_t height, int bit_depth, int color_type, int interlace,
+             StreamProfile *prof = nullptr) {
+    bits = channels(color_type)*bit_depth;
+    if(width <= 0 || height <= 0 || bits == 0 || interlace > 1) return false;
+    uint64_t len = rowBytes(width,bits);
+    if(len > MAX_ROW) return false;
+    bpp = bits >= 8 ? bits/8 : 1;
+    if(interlace == 0) {
+      addPass(width,height);
+    }
+    else {
+      for(int p=0; p<7; p++) {
+        addPass(adam7Size(width,adam7_x0[p],adam7_dx[p]),adam7Size(height,adam7_y0[p],adam7_dy[p]));
+      }
+    }
+    profile = prof;
+    if(profile) {
+      for(Pass &p : passes) profile->addRows(p.row_size,p.width ? p.height : 0);
+      profile->plan();
+    }
+    prev.resize(1+len); // the longest rows
+    cur.resize(1+len);
+    pass = 0;
+    startPass();
+    active = true;
+    return true;
+  }
+
+  bool complete() const { return pass == passes.size(); }
+
+  // takes the next bytes of the decompressed data (after the last row they are ignored)
+  void consume(const unsigned char *data, size_t n) {
+    while(n > 0 && pass < passes.size()) {
+      size_t row_size = passes[pass].row_size;
+      size_t k = std::min(n,row_size-fill);
+      memcpy(cur.data()+fill,data,k);
+      fill += k;
+      data += k;
+      n -= k;
+      if(fill == row_size) {
+        endRow();
+        fill = 0;
+      }
+    }
+  }
+
+private:
+  void addPass(uint64_t width, uint64_t height) {
+    Pass p;
+    p.width = width;
+    p.height = height;
+    p.row_size = width ? 1+rowBytes(width,bits) : 0;
+    p.rows = 0;
+    for(int i=0; i<5; i++) p.filter_counts[i] = 0;
+    passes.push_back(p);
+  }
+
+  // skips the empty passes, the row above the first one of a pass is made of zeros
+  void startPass() {
+    while(pass < passes.size() && (passes[pass].width == 0 || passes[pass].height == 0)) pass++;
+    if(pass < passes.size()) memset(prev.data(),0,passes[pass].row_size);
+  }
+
+  void endRow() {
+    Pass &p = passes[pass];
+    int type = cur[0];
+    if(type > 4) {
+      if(invalid_filters == 0) {
+        first_invalid_row = p.rows;
+        first_invalid_pass = (int)pass;
+        first_invalid_type = type;
+      }
+      invalid_filters++;
+    }
+    else {
+      p.filter_counts[type]++;
+      filter_counts[type]++;
+      unfilter(type,cur.data()+1,prev.data()+1,p.row_size-1,bpp);
+    }
+    if(profile) profile->row(type);
+    prev.swap(cur);
+    rows++;
+    if(++p.rows == p.height) {
+      pass++;
+      startPass();
+    }
+  }
+};
+
+// The zlib stream
+
+class ImageDataStream {
+  z_stream strm;
+  bool started;
+  std::vector<unsigned char> buffer; // the decompressed data goes through it
+
+public:
+  static const size_t BUFFER_SIZE = 1 << 16;
+
+  bool ended;            // end of the zlib stream met
+  bool failed;           // zlib error met, the rest of the data is ignored
+  uint64_t in_bytes;     // compressed bytes given
+  uint64_t out_bytes;    // decompressed bytes
+  uint64_t extra_bytes;  // compressed bytes after the end of the stream
+  std::string message;   // description of the zlib error
+  RowDecoder *rows;      // receives the decompressed data, if not null
+  StreamProfile *profile; // follows the compressed size of the rows, if not null
+  unsigned char zlib_header[2]; // CMF and FLG
+  int zlib_header_len;
+
+  ImageDataStream() : started(false), ended(false), failed(false), in_bytes(0), out_bytes(0),
+                      extra_bytes(0), rows(nullptr), profile(nullptr), zlib_header_len(0) {}
+  ~ImageDataStream() {
+    if(started) inflateEnd(&strm);
+  }
+
+  bool active() const { return started && !ended && !failed; }
+
+  // compressed bytes consumed by zlib
+  uint64_t consumed() const { return started ? strm.total_in : 0; }
+
+  // inflates the content of an IDAT chunk, returns false on the first zlib error
+  bool feed(const unsigned char *data, size_t len) {
+    if(failed) return true; // already reported
+    for(size_t i=0; i<len && zlib_header_len<2; i++) zlib_header[zlib_header_len++] = data[i];
+    in_bytes += len;
+    if(ended) {
+      extra_bytes += len;
+      return true;
+    }
+    if(!started) {
+      strm.zalloc = Z_NULL;
+      strm.zfree = Z_NULL;
+      strm.opaque = Z_NULL;
+      strm.avail_in = 0;
+      strm.next_in = Z_NULL;
+      if(inflateInit(&strm) != Z_OK) {
+        failed = true;
+        message = "unable to initialize zlib";
+        return false;
+      }
+      buffer.resize(BUFFER_SIZE);
+      started = true;
+    }
+    // avail_in is 32 bits wide, a chunk is less than 2^31 bytes
+    strm.next_in = (unsigned char *) data; // zlib does not modify the input
+    strm.avail_in = (uInt) len;
+    do {
+      size_t size = buffer.size();
+      if(profile) { // stop at the end of the band
+        uint64_t end = profile->nextEnd();
+        if(end > out_bytes && end-out_bytes < size) size = (size_t)(end-out_bytes);
+      }
+      strm.next_out = buffer.data();
+      strm.avail_out = (uInt) size;
+      int ret = inflate(&strm,Z_NO_FLUSH);
+      size_t have = size-strm.avail_out;
+      out_bytes += have;
+      if(rows) rows->consume(buffer.data(),have);
+      if(profile) profile->progress(out_bytes,strm.total_in);
+      switch(ret) {
+      case Z_STREAM_END :
+        ended = true;
+        extra_bytes += strm.avail_in;
+        if(profile) profile->finish(strm.total_in);
+        return true;
+      case Z_OK :
+        break;
+      case Z_BUF_ERROR : // no progress possible: all the input is used
+        return true;
+      case Z_NEED_DICT :
+        failed = true;
+        message = "a preset dictionary is required (not allowed in PNG)";
+        return false;
+      default :
+        failed = true;
+        message = strm.msg ? strm.msg : "zlib error";
+        if(message == "incorrect data check") message = "Adler-32 checksum incorrect";
+        return false;
+      }
+    } while(strm.avail_in > 0 || strm.avail_out == 0);
+    return true;
+  }
+};
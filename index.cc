@@ -0,0 +1,144 @@
+// Chunk index sidecar files (option --index)
+//
+// The chunks found in a file (type, offset, length, stored and computed CRC)
+// are saved next to it in "filename-PNGan.idx", with the size, modification
+// time and inode of the file. When the file is analysed again and has not
+// changed, the CRCs are not computed again and the image data chunks are
+// not read at all (unless they are decompressed). The other chunks are still
+// read and handled: the report is made again, not taken from the index.
+//
+// Format (integers in little endian):
+//   "PNGanIdx", version (4 bytes),
+//   file size (8), mtime seconds (8), mtime nanoseconds (4), inode (8),
+//   number of chunks (4), then for each chunk:
+//   name (4), offset (8), length (4), crc (4), computed crc (4), flags (1)
+
+#ifndef _WIN32
+#include <sys/stat.h>
+#endif
+#include <cstdio>
+
+struct FileKey {
+  uint64_t size, mtime, inode;
+  uint32_t mtime_ns;
+};
+
+// returns false if the key cannot be known (then no index is used)
+bool fileKey(const char *filename, FileKey &key) {
+#ifndef _WIN32
+  struct stat st;
+  if(stat(filename,&st) != 0 || !S_ISREG(st.st_mode)) return false;
+  key.size = st.st_size;
+  key.mtime = st.st_mtime;
+#ifdef __APPLE__
+  key.mtime_ns = st.st_mtimespec.tv_nsec;
+#else
+  key.mtime_ns = st.st_mtim.tv_nsec;
+#endif
+  key.inode = st.st_ino;
+  return true;
+#else
+  return false;
+#endif
+}
+
+class IndexFile {
+  static const uint32_t VERSION_NUMBER = 1;
+  static const size_t HEADER_SIZE = 8+4+8+8+4+8+4;
+  static const size_t ENTRY_SIZE = 4+8+4+4+4+1;
+  std::string buffer;
+
+  void put(uint64_t v, int n) {
+    for(int i=0; i<n; i++) buffer += (char)(v >> (8*i));
+  }
+
+  static uint64_t get(const unsigned char *p, int n) {
+    uint64_t v = 0;
+    for(int i=n-1; i>=0; i--) v = (v << 8) | p[i];
+    return v;
+  }
+
+  void putKey(const FileKey &key) {
+    buffer.assign("PNGanIdx",8);
+    put(VERSION_NUMBER,4);
+    put(key.size,8);
+    put(key.mtime,8);
+    put(key.mtime_ns,4);
+    put(key.inode,8);
+  }
+
+public:
+  static std::string path(const char *filename) { return std::string(filename)+"-PNGan.idx"; }
+
+  // the chunks of the index if it exists and the file has not changed
+  bool load(const std::string &path, const FileKey &key, std::vector<PngChunk> &chunks) {
+    std::ifstream f(path,std::ifstream::binary);
+    if(!f) return false;
+    std::string data((std::istreambuf_iterator<char>(f)),std::istreambuf_iterator<char>());
+    putKey(key);
+    if(data.size() < HEADER_SIZE || data.compare(0,buffer.size(),buffer) != 0) return false;
+    const unsigned char *p = (const unsigned char *) data.data()+buffer.size();
+    size_t count = (size_t) get(p,4);
+    p += 4;
+    if(data.size() != HEADER_SIZE+count*ENTRY_SIZE) return false;
+    chunks.resize(count);
+    for(PngChunk &c : chunks) {
+      memcpy(c.name,p,4);
+      c.name[4] = 0;
+      c.offset = (std::streamoff) get(p+4,8);
+      c.length = (int32_t) get(p+12,4);
+      c.crc = (uint32_t) get(p+16,4);
+      c.computed_crc = (uint32_t) get(p+20,4);
+      c.crc_checked = p[24] & 1;
+      c.crc_ok = (p[24] & 2) != 0;
+      p += ENTRY_SIZE;
+    }
+    return true;
+  }
+
+  // written to a temporary file then renamed, so that a reader never sees half of it
+  bool save(const std::string &path, const FileKey &key, const std::vector<PngChunk> &chunks) {
+    putKey(key);
+    put(chunks.size(),4);
+    for(const PngChunk &c : chunks) {
+      buffer.append(c.name,4);
+      put(c.offset,8);
+      put((uint32_t) c.length,4);
+      put(c.crc,4);
+      put(c.computed_crc,4);
+      put((c.crc_checked ? 1 : 0) | (c.crc_ok ? 2 : 0),1);
+    }
+    std::string tmp = path+".tmp";
+    {
+      std::ofstream f(tmp,std::ofstream::binary);
+      if(!f.write(buffer.data(),buffer.size())) return false;
+    }
+    return std::rename(tmp.c_str(),path.c_str()) == 0;
+  }
+};
+
+bool sameChunks(const std::vector<PngChunk> &a, const std::vector<PngChunk> &b) {
+  if(a.size() != b.size()) return false;
+  for(size_t i=0; i<a.size(); i++) {
+    if(memcmp(a[i].name,b[i].name,4) != 0 || a[i].offset != b[i].offset || a[i].length != b[i].length
+       || a[i].crc != b[i].crc || a[i].computed_crc != b[i].computed_crc
+       || a[i].crc_checked != b[i].crc_checked || a[i].crc_ok != b[i].crc_ok) return false;
+  }
+  return true;
+}
+
+// Visitor keeping the chunks for the index, and passing everything to another visitor
+
+class IndexVisitor : public PngVisitor {
+  PngVisitor &next;
+
+public:
+  std::vector<PngChunk> chunks;
+
+  explicit IndexVisitor(PngVisitor &v) : next(v) {}
+
+  void on_chunk(const PngChunk &c) { chunks.push_back(c); next.on_chunk(c); }
+  void on_header(const PngHeader &h) { next.on_header(h); }
+  void on_text(const PngText &t) { next.on_text(t); }
+  void on_error(const std::string &message, bool fatal) { next.on_error(message,fatal); }
+};
@@ -0,0 +1,229 @@
+// Input of the PNG data
+//
+// The file is memory mapped when possible: the chunks are then handed out
+// as views (pointer, length) inside the mapping, without any copy.
+// Otherwise (pipes, special files, systems without mmap) the data is read
+// from a stream into a reusable buffer.
+//
+// Data already in memory can also be analysed (MemoryInput).
+// A view returned by read() is only valid until the next call.
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+class StreamInput : public Input {
+  std::ifstream file;
+  std::istream &is;
+  std::vector<unsigned char> buffer;
+
+  /*
+  when read fails, this can be for two reasons.
+  The function below will determine which and throw the corresponding error.
+  */
+  void call_err() {
+    if(is.eof())
+      throw erreur_eof;
+    else
+      throw erreur_read;
+  }
+
+public:
+  StreamInput(const char *filename) : file(filename,std::ifstream::binary), is(file) {}
+  explicit StreamInput(std::istream &in) : is(in) {}
+
+  bool good() { return (bool)is; }
+
+  // the file is read by morsels of at most 65535 bytes so that a corrupted
+  // chunk length does not make us allocate a huge buffer before meeting EOF
+  const unsigned char* read(size_t n) {
+    size_t done = 0;
+    while(done < n) {
+      size_t len = std::min(n-done,(size_t)65535);
+      if(buffer.size() < done+len) buffer.resize(done+len); // capacity is kept
+      if(!is.read((char*) buffer.data()+done,len)) call_err();
+      done += len;
+    }
+    pos += n;
+    return buffer.data();
+  }
+
+  void skip(size_t n) {
+    if(!is.ignore(n) || (size_t)is.gcount() != n) call_err();
+    pos += n;
+  }
+
+  bool atEnd() {
+    return is.peek() == EOF;
+  }
+
+  std::streamoff remaining() {
+    is.ignore(std::numeric_limits<std::streamsize>::max());
+    return is.gcount();
+  }
+};
+
+#ifndef _WIN32
+
+class MappedInput : public Input {
+  const unsigned char *base;
+  std::streamoff size;
+
+public:
+  MappedInput() : base(nullptr), size(0) {}
+  ~MappedInput() {
+    if(base) munmap((void*) base,size);
+  }
+
+  // returns false if the file cannot be mapped (the caller then falls back to a stream)
+  bool open(const char *filename) {
+    int fd = ::open(filename,O_RDONLY);
+    if(fd < 0) return false;
+    struct stat st;
+    if(fstat(fd,&st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+      close(fd);
+      return false;
+    }
+    void *p = mmap(nullptr,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+    close(fd); // the mapping stays valid
+    if(p == MAP_FAILED) return false;
+    madvise(p,st.st_size,MADV_SEQUENTIAL);
+    base = (const unsigned char*) p;
+    size = st.st_size;
+    return true;
+  }
+
+  const unsigned char* read(size_t n) {
+    if((std::streamoff)n > size-pos) {
+      pos = size;
+      throw erreur_eof;
+    }
+    const unsigned char *p = base+pos;
+    pos += n;
+    return p;
+  }
+
+  bool atEnd() {
+    return pos >= size;
+  }
+
+  std::streamoff remaining() {
+    return size-pos;
+  }
+
+  const unsigned char* contents(size_t &n) {
+    n = (size_t) size;
+    return base;
+  }
+};
+
+#endif
+
+class MemoryInput : public Input {
+  const unsigned char *base;
+  std::streamoff size;
+
+public:
+  MemoryInput(const unsigned char *data, size_t n) : base(data), size(n) {}
+
+  const unsigned char* read(size_t n) {
+    if((std::streamoff)n > size-pos) {
+      pos = size;
+      throw erreur_eof;
+    }
+    const unsigned char *p = base+pos;
+    pos += n;
+    return p;
+  }
+
+  bool atEnd() {
+    return pos >= size;
+  }
+
+  std::streamoff remaining() {
+    return size-pos;
+  }
+
+  const unsigned char* contents(size_t &n) {
+    n = (size_t) size;
+    return base;
+  }
+};
+
+// The next bytes of another input (a file inside an archive): reads beyond
+// them fail as at the end of a file. Nothing is copied: with a memory
+// mapped input the views are inside the same mapping.
+
+class BoundedInput : public Input {
+  Input &in;
+  std::streamoff origin, size;  // position in "in" and number of bytes
+
+public:
+  BoundedInput(Input &parent, std::streamoff n) : in(parent), origin(parent.pos), size(n) {}
+
+  const unsigned char* read(size_t n) {
+    if((std::streamoff)n > size-pos) {
+      pos = size;
+      throw erreur_eof;
+    }
+    const unsigned char *p = in.read(n);
+    pos += n;
+    return p;
+  }
+
+  void skip(size_t n) {
+    if((std::streamoff)n > size-pos) {
+      pos = size;
+      throw erreur_eof;
+    }
+    in.skip(n);
+    pos += n;
+  }
+
+  bool atEnd() {
+    return pos >= size;
+  }
+
+  std::streamoff remaining() {
+    std::streamoff n = size-pos;
+    in.skip((size_t)n);
+    pos = size;
+    return n;
+  }
+
+  const unsigned char* contents(size_t &n) {
+    const unsigned char *base = in.contents(n);
+    if(!base) return nullptr;
+    n = (size_t) size;
+    return base+origin;
+  }
+};
+
+std::unique_ptr<Input> boundedInput(Input &in, std::streamoff size) {
+  return std::unique_ptr<Input>(new BoundedInput(in,size));
+}
+
+std::unique_ptr<Input> streamInput(std::istream &in) {
+  return std::unique_ptr<Input>(new StreamInput(in));
+}
+
+std::unique_ptr<Input> memoryInput(const unsigned char *data, size_t size) {
+  return std::unique_ptr<Input>(new MemoryInput(data,size));
+}
+
+// Opens the file, memory mapped if possible, returns nullptr on failure
+
+std::unique_ptr<Input> openInput(const char *filename) {
+#ifndef _WIN32
+  MappedInput *m = new MappedInput;
+  std::unique_ptr<Input> mapped(m);
+  if(m->open(filename)) return mapped;
+#endif
+  StreamInput *s = new StreamInput(filename);
+  std::unique_ptr<Input> stream(s);
+  if(!s->good()) return nullptr;
+  return stream;
+}
@@ -0,0 +1,288 @@
+// Machine readable output (options --json and --ndjson)
+//
+// --json   : one JSON object per file, on one line
+// --ndjson : one JSON object per line for each chunk, header, text and
+//            error, in the order of the file, then one "end" line
+//
+// The text is built in a buffer (JsonWriter) and written to the stream by
+// large blocks: at the end of the file, or when the buffer gets big.
+
+enum OutputFormat { FORMAT_REPORT, FORMAT_JSON, FORMAT_NDJSON };
+
+class JsonWriter {
+  std::string buffer;
+
+public:
+  JsonWriter &raw(const char *s) { buffer += s; return *this; }
+  JsonWriter &key(const char *k) { buffer += '"'; buffer += k; buffer += "\":"; return *this; }
+  JsonWriter &boolean(bool b) { buffer += b ? "true" : "false"; return *this; }
+
+  JsonWriter &number(long long n) {
+    char tmp[24];
+    snprintf(tmp,sizeof(tmp),"%lld",n);
+    buffer += tmp;
+    return *this;
+  }
+
+  // the string is expected in utf-8, invalid sequences are replaced by U+FFFD
+  JsonWriter &string(const char *s, size_t len) {
+    static const char hex[] = "0123456789abcdef";
+    const unsigned char *p = (const unsigned char *) s;
+    buffer += '"';
+    size_t i = 0;
+    while(i < len) {
+      unsigned char c = p[i];
+      if(c >= 0x80) {
+        size_t n = utf8Length(p+i,len-i);
+        if(n) buffer.append(s+i,n);
+        else buffer += "\xef\xbf\xbd";
+        i += n ? n : 1;
+        continue;
+      }
+      switch(c) {
+      case '"'  : buffer += "\\\""; break;
+      case '\\' : buffer += "\\\\"; break;
+      case '\n' : buffer += "\\n"; break;
+      case '\r' : buffer += "\\r"; break;
+      case '\t' : buffer += "\\t"; break;
+      default :
+        if(c < 0x20) {
+          buffer += "\\u00";
+          buffer += hex[c >> 4];
+          buffer += hex[c & 15];
+        }
+        else buffer += (char) c;
+      }
+      i++;
+    }
+    buffer += '"';
+    return *this;
+  }
+  JsonWriter &string(const std::string &s) { return string(s.data(),s.size()); }
+
+  // length of the valid utf-8 sequence starting at p, 0 if invalid
+  static size_t utf8Length(const unsigned char *p, size_t len) {
+    unsigned char c = p[0];
+    size_t n;
+    uint32_t cp;
+    if(c >= 0xc2 && c <= 0xdf) { n = 2; cp = c & 0x1f; }
+    else if(c >= 0xe0 && c <= 0xef) { n = 3; cp = c & 0x0f; }
+    else if(c >= 0xf0 && c <= 0xf4) { n = 4; cp = c & 0x07; }
+    else return 0;
+    if(n > len) return 0;
+    for(size_t i=1; i<n; i++) {
+      if((p[i] & 0xc0) != 0x80) return 0;
+      cp = (cp << 6) | (p[i] & 0x3f);
+    }
+    // overlong forms, surrogates and values beyond U+10FFFF
+    if((n == 3 && cp < 0x800) || (n == 4 && (cp < 0x10000 || cp > 0x10ffff))
+       || (cp >= 0xd800 && cp <= 0xdfff)) return 0;
+    return n;
+  }
+
+  size_t size() const { return buffer.size(); }
+
+  // moves the content at the end of another writer
+  void flushTo(JsonWriter &j) {
+    j.buffer += buffer;
+    buffer.clear();
+  }
+
+  void flush(std::ostream &out) {
+    out.write(buffer.data(),buffer.size());
+    buffer.clear();
+  }
+};
+
+// Visitor writing the results of the analysis of one file
+
+class JsonVisitor : public PngVisitor {
+  std::ostream &out;
+  bool ndjson;
+  std::string filename;
+  JsonWriter w;                   // --json: the object, --ndjson: the lines
+  JsonWriter chunks, texts, errors; // --json: the members of the object
+  bool has_header;
+  PngHeader header;
+
+  // --ndjson: beginning of a line
+  JsonWriter &line(const char *type) {
+    w.raw("{").key("file").string(filename).raw(",").key("type").string(type,strlen(type));
+    return w;
+  }
+
+  // in --ndjson mode the lines are written as soon as there are enough of them
+  void endLine() {
+    w.raw("}\n");
+    if(w.size() >= (1 << 16)) w.flush(out);
+  }
+
+  static void separator(JsonWriter &j) { if(j.size()) j.raw(","); }
+
+public:
+  JsonVisitor(std::ostream &o, bool nd, const char *name)
+    : out(o), ndjson(nd), filename(name), has_header(false) {}
+
+  void on_chunk(const PngChunk &c) {
+    JsonWriter &j = ndjson ? line("chunk").raw(",") : chunks;
+    if(!ndjson) { separator(j); j.raw("{"); }
+    j.key("name").string(c.name,strlen(c.name))
+     .raw(",").key("offset").number(c.offset)
+     .raw(",").key("length").number(c.length)
+     .raw(",").key("crc").number(c.crc)
+     .raw(",").key("crc_ok");
+    if(c.crc_checked) j.boolean(c.crc_ok);
+    else j.raw("null");
+    if(ndjson) endLine();
+    else j.raw("}");
+  }
+
+  void on_header(const PngHeader &h) {
+    if(ndjson) {
+      line("header").raw(",");
+      writeHeader(w,h);
+      endLine();
+    }
+    else {
+      has_header = true;
+      header = h;
+    }
+  }
+
+  void on_text(const PngText &t) {
+    JsonWriter &j = ndjson ? line("text").raw(",") : texts;
+    if(!ndjson) { separator(j); j.raw("{"); }
+    j.key("chunk").string(t.chunk,strlen(t.chunk))
+     .raw(",").key("keyword").string(t.keyword);
+    if(t.chunk[0] == 'i') {
+      j.raw(",").key("language").string(t.language)
+       .raw(",").key("translated_keyword").string(t.translated_keyword);
+    }
+    if(t.decoded) j.raw(",").key("text").string(t.text);
+    if(ndjson) endLine();
+    else j.raw("}");
+  }
+
+  void on_error(const std::string &message, bool fatal) {
+    JsonWriter &j = ndjson ? line("error").raw(",") : errors;
+    if(!ndjson) { separator(j); j.raw("{"); }
+    j.key("message").string(message).raw(",").key("fatal").boolean(fatal);
+    if(ndjson) endLine();
+    else j.raw("}");
+  }
+
+  static void writeHeader(JsonWriter &j, const PngHeader &h) {
+    j.key("width").number(h.width)
+     .raw(",").key("height").number(h.height)
+     .raw(",").key("bit_depth").number(h.bit_depth)
+     .raw(",").key("color_type").number(h.color_type)
+     .raw(",").key("compression").number(h.compression)
+     .raw(",").key("filter").number(h.filter)
+     .raw(",").key("interlace").number(h.interlace);
+  }
+
+  // writes the end of the results: the whole object (--json) or the "end" line (--ndjson)
+  void finish(const PngResult &r) {
+    if(ndjson) line("end").raw(",");
+    else {
+      w.raw("{").key("file").string(filename).raw(",");
+      w.key("signature_ok").boolean(r.signature_ok).raw(",");
+      w.key("header");
+      if(has_header) { w.raw("{"); writeHeader(w,header); w.raw("}"); }
+      else w.raw("null");
+      w.raw(",").key("chunks").raw("[");
+      chunks.flushTo(w);
+      w.raw("],").key("texts").raw("[");
+      texts.flushTo(w);
+      w.raw("],").key("errors").raw("[");
+      errors.flushTo(w);
+      w.raw("],");
+    }
+    w.key("fatal_error").number(r.fatal_error)
+     .raw(",").key("error_count").number(r.error_count)
+     .raw(",").key("bad_crc_count").number(r.bad_crc_count)
+     .raw(",").key("unchecked_crc_count").number(r.unchecked_crc_count)
+     .raw(",").key("known_crc_count").number(r.known_crc_count)
+     .raw(",").key("idat_chunks").number(r.total_idat_chunks)
+     .raw(",").key("idat_bytes").number(r.total_idat_bytes)
+     .raw(",").key("text_chunks").number(r.total_text_chunks);
+    if(r.data_checked) {
+      w.raw(",").key("data_bytes").number(r.data_bytes)
+       .raw(",").key("expected_data_bytes").number(r.expected_data_bytes);
+    }
+    if(r.rows_checked) {
+      w.raw(",").key("rows").number(r.rows).raw(",").key("filters").raw("[");
+      for(int i=0; i<5; i++) {
+        if(i) w.raw(",");
+        w.number(r.filter_counts[i]);
+      }
+      w.raw("],").key("invalid_filters").number(r.invalid_filters);
+      if(!r.passes.empty()) {
+        w.raw(",").key("passes").raw("[");
+        for(size_t p=0; p<r.passes.size(); p++) {
+          const PngPass &pass = r.passes[p];
+          if(p) w.raw(",");
+          w.raw("{").key("width").number(pass.width)
+           .raw(",").key("height").number(pass.height)
+           .raw(",").key("rows").number(pass.rows)
+           .raw(",").key("bytes").number(pass.bytes)
+           .raw(",").key("filters").raw("[");
+          for(int i=0; i<5; i++) {
+            if(i) w.raw(",");
+            w.number(pass.filter_counts[i]);
+          }
+          w.raw("]}");
+        }
+        w.raw("]");
+      }
+    }
+    if(r.zlib_level >= 0) {
+      w.raw(",").key("zlib_window").number(r.zlib_window)
+       .raw(",").key("zlib_level").number(r.zlib_level);
+    }
+    if(!r.bands.empty()) {
+      w.raw(",").key("bands").raw("[");
+      for(size_t b=0; b<r.bands.size(); b++) {
+        const PngBand &band = r.bands[b];
+        if(b) w.raw(",");
+        w.raw("{").key("first_row").number(band.first_row)
+         .raw(",").key("rows").number(band.rows)
+         .raw(",").key("raw_bytes").number(band.raw_bytes)
+         .raw(",").key("compressed_bytes").number(band.compressed_bytes)
+         .raw(",").key("filters").raw("[");
+        for(int i=0; i<5; i++) {
+          if(i) w.raw(",");
+          w.number(band.filter_counts[i]);
+        }
+        w.raw("],").key("invalid_filters").number(band.invalid_filters).raw("}");
+      }
+      w.raw("]");
+    }
+    if(r.stopped_early) {
+      static const char *names[] = {HEADER, EMBEDDED_ICC, SRGB, GAMMA};
+      w.raw(",").key("stopped_early").boolean(true).raw(",").key("fields_found").raw("[");
+      bool first = true;
+      for(int i=0; i<4; i++) {
+        if(!(r.fields_found & (1u << i))) continue;
+        if(!first) w.raw(",");
+        w.string(names[i],4);
+        first = false;
+      }
+      w.raw("]");
+    }
+    if(!r.phases.empty()) {
+      w.raw(",").key("timings").raw("[");
+      for(size_t i=0; i<r.phases.size(); i++) {
+        const PngPhase &p = r.phases[i];
+        if(i) w.raw(",");
+        w.raw("{").key("phase").string(p.name)
+         .raw(",").key("ns").number(p.nanoseconds)
+         .raw(",").key("bytes").number(p.bytes)
+         .raw(",").key("calls").number(p.calls).raw("}");
+      }
+      w.raw("]");
+    }
+    w.raw("}\n");
+    w.flush(out);
+  }
+};
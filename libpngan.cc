@@ -0,0 +1,764 @@
+/*
+
+PNGan library: analysis of a PNG file (see pngan.h)
+
+Language : C++ (version: C++11)
+
+Compilation : see pngan.h, or PNGan.cc for the program
+
+Author : Arnaud Chéritat
+
+Licence : CC-BY-SA
+
+*/
+
+#include "pngan.h"
+
+// Libraries
+
+#include <zlib.h>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <limits>
+#include <vector>
+#include <algorithm>
+#include <cstring> // bad, used for strcmp and strncmp
+#include <cstdlib>
+
+erreur_eof_struct  erreur_eof;
+erreur_read_struct erreur_read;
+erreur_neg_struct  erreur_neg;
+
+#include "threads.h"
+
+std::unique_ptr<ThreadPool> pool; // shared by the whole program
+unsigned jobs = 0;                // requested number of threads (0 = number of processors)
+
+ThreadPool &getPool() {
+  static std::once_flag once;
+  std::call_once(once,[]{
+    unsigned n = jobs ? jobs : std::thread::hardware_concurrency();
+    pool.reset(new ThreadPool(n ? n : 1));
+  });
+  return *pool;
+}
+
+#include "crc.cc"
+
+#include "input.cc"
+
+#include "filter.cc"
+
+#include "idat.cc"
+
+#include "timing.cc"
+
+#include "text.cc"
+
+/* Big endian integers of N bytes (1, 2 or 4), signed or not
+ *
+ * Built byte by byte, so that it works whatever the endianness and the
+ * encoding of the integer types on the system; the conversion of the
+ * signed values avoids any overflow (undefined behaviour under the C++
+ * standard). Everything is known at compile time: a load is a few
+ * instructions on a view of the chunk, without any allocation.
+ *
+ *   uint32_t crc = BigEndian<4,false>::load(p);
+ */
+template<int N, bool Signed> struct BigEndian;
+
+template<> struct BigEndian<1,false> {
+  typedef uint8_t type;
+  static constexpr type load(const unsigned char *p) { return p[0]; }
+};
+
+template<> struct BigEndian<2,false> {
+  typedef uint16_t type;
+  static constexpr type load(const unsigned char *p) { return (type)(p[0] << 8 | p[1]); }
+};
+
+template<> struct BigEndian<4,false> {
+  typedef uint32_t type;
+  static constexpr type load(const unsigned char *p) {
+    return (type)p[0] << 24 | (type)p[1] << 16 | (type)p[2] << 8 | (type)p[3];
+  }
+};
+
+template<> struct BigEndian<4,true> {
+  typedef int32_t type;
+  static constexpr type load(const unsigned char *p) {
+    return p[0] < 128 ? (type) BigEndian<4,false>::load(p)
+                      : -(type)(~BigEndian<4,false>::load(p)) - 1;
+  }
+};
+
+// Non-fatal errors
+//
+// usage: error() << "Error: ..." << value << "\n";
+// at the end of the statement the message is written in the report,
+// counted and given to the visitor
+
+class Analysis;
+
+class ErrorMessage {
+  Analysis *analysis;
+  std::ostringstream message;
+public:
+  explicit ErrorMessage(Analysis *a) : analysis(a) {}
+  ErrorMessage(ErrorMessage &&e) : analysis(e.analysis), message(e.message.str()) { e.analysis = nullptr; }
+  ~ErrorMessage();
+
+  template<typename T>
+  ErrorMessage &operator<<(const T &value) { message << value; return *this; }
+  ErrorMessage &operator<<(std::ostream &(*manip)(std::ostream &)) { message << manip; return *this; }
+};
+
+struct ChunkType; // see handlers.cc
+
+// Analysis of one file
+//
+// All the state of the analysis of a file lives in this class, so that
+// several files can be analysed at the same time by different threads.
+// The handlers (handlers.cc) are members.
+// The report is written to "out", the results also go to the visitor.
+
+class Analysis {
+public:
+  std::ostream  &out;          // where the report is written
+  PngVisitor    &visitor;      // receives the results
+  PngOptions     options;
+  Input         *input;        // the PNG image
+  bool           input_in_memory; // memory mapped: the chunks are views, whatever their size
+  static const int32_t MORSEL = 1 << 16; // otherwise, how big image data chunks are read
+  unsigned char  signature[10];
+  bool           signature_ok;  // the file starts with the PNG signature
+  int32_t        width, height;
+  unsigned char  bit_depth, color_type, compression, filter, interlace;
+  bool           palette_used, color_used, alpha_used; // color type flags 
+  bool           end_chunk_met;
+  bool           stopped;        // option header_only: the fields are found or the image data reached
+  unsigned       fields_found;   // option header_only
+  std::streamoff chunk_start, chunk_next;
+  long int       palette_size;
+
+  int32_t        chunk_length;   // PNG standard tells something strange about the sign here
+  char           chunk_name[5];  // null terminated C-style array
+  uint32_t       chunk_id;       // the same as an integer (FourCC)
+  const ChunkType *chunk_type;   // nullptr if unknown
+  const unsigned char *chunk_data; // content of the current chunk (view given by the input)
+  int32_t        chunk_pos;      // read position of the handlers in chunk_data
+  uint32_t       chunk_crc;
+
+  std::streamoff total_idat_chunks;
+  std::streamoff total_idat_bytes;
+  std::streamoff bad_crc_count;
+  std::streamoff unchecked_crc_count;
+  std::streamoff known_crc_count;
+  int            crc_sample_credit; // option crc_policy: a CRC is checked each time it reaches 100
+  std::streamoff total_text_chunks;
+
+  long int       error_count;
+
+  bool first_chunk;      // is current chunk the first one ?
+  bool header_met;       // HEADER chunk met ?
+  bool palette_met;
+  bool data_met;
+  bool data_ended;
+  bool data_error;
+  bool end_met;
+  bool background_met;
+  bool chroma_met;
+  bool gamma_met;
+  bool histogram_met;
+  bool pixel_met;
+  bool transparency_met;
+  bool bits_met;
+
+  std::string    keyword;        // of the current text chunk, utf-8
+
+  ImageDataStream image_data;    // option inflate
+  RowDecoder     row_decoder;    // option unfilter
+  StreamProfile  profile;        // option profile
+  bool           image_data_started;
+  bool           image_data_done; // end of the image data reported
+  int64_t        expected_data_bytes;
+
+  PhaseTimer     timer;          // option timings
+  std::vector<unsigned char> ztext_block; // output of the decompression of the texts
+
+  Analysis(std::ostream &o, PngVisitor &v, const PngOptions &opt) : out(o), visitor(v), options(opt) {}
+
+  // analyses the file, returns 0 or the code of the fatal error met
+  int run(Input &in);
+
+  // non-fatal errors: see ErrorMessage
+  ErrorMessage error() { return ErrorMessage(this); }
+  void reportError(const std::string &message);
+  int  fatalError(const char *message, int code);
+  int  endHeaderOnly();
+
+  void readSignature(int n);
+  template<int N, bool Signed, typename Int>
+  void readNumber(Int& dest);
+  void readChunkHeader();
+  void chunkRead();
+  static unsigned headerField(uint32_t id);
+  void skipChunk();
+  bool crcSampled();
+  const PngChunk *knownChunk();
+
+  // handlers.cc
+
+  bool readKeyword(const char* key_text, bool output);
+  void output_ztext(const unsigned char *buffer, size_t len, const char* head_text, const char* trail_text, bool latin1, std::ostream &dest, std::string *copy = nullptr, Utf8Validator *utf8 = nullptr);
+  void checkUtf8(const unsigned char *text, size_t len, const char *what);
+  void reportUtf8(Utf8Validator &v, const char *what);
+  void handleHeader(bool output);
+  void handlePalette(bool output);
+  void handleData(bool output);
+  void feedImageData(const unsigned char *data, size_t len);
+  void handleEnd(bool output);
+  void handleBackground(bool output);
+  void handleChroma(bool output);
+  void handleGamma(bool output);
+  void handleHistogram(bool output);
+  void handlePixel(bool output);
+  void handleBits(bool output);
+  void handleTime(bool output);
+  void handleTransparency(bool output);
+  void handleText(bool output);
+  void handleZtext(bool output);
+  void handleItext(bool output);
+  void handleICCP(bool output);
+  void handleSRGB(bool output);
+  void handleUnknown(bool output);
+  void handleNotHandled(bool output);
+  void handleDeprecated(bool output);
+  bool placementOk(int order);
+  void checkOrder();
+  void handleChunk();
+  void endImageData();
+  void outputProfile();
+};
+
+const int32_t Analysis::MORSEL; // std::min takes it by reference
+
+ErrorMessage::~ErrorMessage() {
+  if(analysis) analysis->reportError(message.str());
+}
+
+void Analysis::reportError(const std::string &message) {
+  out << message;
+  error_count++;
+  // the visitor gets the message without the layout of the report
+  size_t a = message.find_first_not_of("\n \"");
+  size_t b = message.find_last_not_of("\n ");
+  visitor.on_error(a == std::string::npos ? std::string() : message.substr(a,b+1-a),false);
+}
+
+int Analysis::fatalError(const char *message, int code) {
+  out << message;
+  std::string m(message);
+  size_t a = m.find_first_not_of("\n ");
+  size_t b = m.find_last_not_of("\n ");
+  visitor.on_error(m.substr(a,b+1-a),true);
+  return code;
+}
+
+/* Reads n bytes from file and puts them in the dynamic array "signature" */
+
+void Analysis::readSignature(int n)
+{
+  memcpy(signature,input->read(n),n);
+}
+
+/* Reads a big endian integer of N bytes from the chunk content, at position
+ * chunk_pos (see BigEndian); dest does not need to be an N bytes type
+ * CAUTION : never call before having called chunkRead
+ */
+template<int N, bool Signed, typename Int>
+void Analysis::readNumber(Int& dest)
+{
+  if(chunk_pos + N > chunk_length) {
+    // should not happen: handlers check chunk_length before reading
+    throw erreur_eof;
+  }
+  dest = (Int) BigEndian<N,Signed>::load(chunk_data + chunk_pos);
+  chunk_pos += N;
+}
+
+/* reads the chunk header (length and name) from the file */
+
+void Analysis::readChunkHeader()
+{
+  const unsigned char *head = input->read(8);
+  chunk_length = BigEndian<4,true>::load(head);
+  memcpy(chunk_name,head+4,4);
+  chunk_name[4]=0; // null terminated C-style string
+  chunk_id = BigEndian<4,false>::load(head+4);
+}
+
+#include "handlers.cc"
+
+
+// reads next chunk and hands its content to the handlers
+// the file index should be at the beginning of the chunk
+
+void Analysis::chunkRead() {
+  using std::hex;
+  using std::dec;
+
+  // read name and size
+  
+  {
+    PhaseTimer::Scope t(timer,PhaseTimer::CHUNK_HEADER,8);
+    readChunkHeader();
+    chunk_type = findChunkType(chunk_id);
+  }
+  if(options.header_only) {
+    if(chunk_id == fourcc(DATA)) { // its content is not read
+      stopped = true;
+      return;
+    }
+    unsigned field = headerField(chunk_id);
+    if(!(field & options.header_only) && chunk_id != fourcc(END)) {
+      skipChunk();
+      return;
+    }
+    fields_found |= field;
+  }
+  if(options.inflate && chunk_id != fourcc(DATA) && total_idat_chunks && !image_data_done) {
+    endImageData();
+  }
+  bool output=(!options.text_only) && !(options.hide_IDAT && chunk_type && chunk_type->flags & SHOW_IDAT) ;
+  if(output) {
+    out << "- Chunk " << chunk_name << " (size = " << chunk_length << " bytes)\n";
+  }
+  if(chunk_length < 0) {
+    throw erreur_neg;
+  }
+
+  // memorize position in chunk_start
+
+  chunk_start = input->pos;
+
+  // the CRC of an image data chunk may be skipped (option crc_policy) or
+  // known from a previous analysis (option known_chunks), its content is
+  // then not even read if it is not decompressed
+
+  const PngChunk *known = knownChunk();
+  bool check_crc = !known && (chunk_id != fourcc(DATA) || crcSampled());
+
+  // a big image data chunk from a stream is not kept in memory: it is read,
+  // checked and decompressed by morsels (its errors come before the CRC one)
+
+  bool by_morsels = chunk_id == fourcc(DATA) && !input_in_memory && chunk_length > MORSEL
+                    && (check_crc || options.inflate);
+
+  // otherwise the content is read once, together with the CRC that follows it,
+  // the handlers then work on this view
+
+  uint32_t crc = update_crc(0xffffffffL,(const unsigned char*) chunk_name,4);
+  {
+    PhaseTimer::Scope t(timer,PhaseTimer::READ,(int64_t)chunk_length+4);
+    if(by_morsels) {
+      for(int32_t left = chunk_length; left > 0; left -= MORSEL) {
+        size_t n = (size_t) std::min(left,MORSEL);
+        const unsigned char *p = input->read(n);
+        if(check_crc) {
+          PhaseTimer::Scope t(timer,PhaseTimer::CRC,n);
+          crc = update_crc(crc,p,n);
+        }
+        feedImageData(p,n);
+      }
+      chunk_data = nullptr;
+      chunk_crc = BigEndian<4,false>::load(input->read(4));
+    }
+    else if(check_crc || options.inflate || chunk_id != fourcc(DATA)) {
+      chunk_data = input->read((size_t)chunk_length+4);
+      chunk_crc = BigEndian<4,false>::load(chunk_data+chunk_length);
+    }
+    else {
+      input->skip((size_t)chunk_length);
+      chunk_data = nullptr;
+      chunk_crc = BigEndian<4,false>::load(input->read(4));
+    }
+  }
+  chunk_pos = 0;
+
+  // CRC (Cyclic Redundancy Check) : value is stored as 4 bytes following the chunk
+  // data for the CRC check include the chunk type (but not the chunk length)
+
+  if(check_crc) {
+    if(!by_morsels) {
+      PhaseTimer::Scope t(timer,PhaseTimer::CRC,chunk_length);
+      crc = update_crc_parallel(crc,chunk_data,chunk_length);
+    }
+    crc = crc ^ 0xffffffffL;
+  }
+  else if(known && known->crc == chunk_crc) {
+    crc = known->computed_crc;
+    check_crc = true;
+    known_crc_count++;
+  }
+  else {
+    crc = chunk_crc;
+    unchecked_crc_count++;
+  }
+    
+  // memorize next chunk position
+  chunk_next=input->pos;
+
+  PngChunk info;
+  memcpy(info.name,chunk_name,5);
+  info.offset = chunk_start;
+  info.length = chunk_length;
+  info.crc = chunk_crc;
+  info.computed_crc = crc;
+  info.crc_checked = check_crc;
+  info.crc_ok = chunk_crc == crc;
+  visitor.on_chunk(info);
+
+  if(chunk_crc != crc) {
+    error() << "\n" << "Error: CRC check incorrect (file tells 0x"
+            << hex << chunk_crc << " computation gives 0x" << crc << dec << ")\n\n";
+    bad_crc_count++;
+  };
+  
+  // Check if the chunk respects chunk ordering rules
+  
+  {
+    PhaseTimer::Scope t(timer,PhaseTimer::ORDER);
+    checkOrder();
+  }
+  
+  // Depending on the chunk name, call appropriate handling function
+
+  handleChunk();
+
+  // line jump
+  
+  if(output) { out << "\n"; }
+
+  if(options.header_only && (fields_found & options.header_only) == options.header_only) {
+    stopped = true;
+  }
+}
+
+// Option known_chunks: the current chunk as found by a previous analysis,
+// nullptr if it was not found or its CRC not checked
+
+const PngChunk *Analysis::knownChunk() {
+  if(!options.known_chunks) return nullptr;
+  const std::vector<PngChunk> &known = *options.known_chunks;
+  auto it = std::lower_bound(known.begin(),known.end(),chunk_start,
+                             [](const PngChunk &c, std::streamoff offset) { return c.offset < offset; });
+  if(it == known.end() || it->offset != chunk_start || it->length != chunk_length
+     || memcmp(it->name,chunk_name,4) != 0 || !it->crc_checked) return nullptr;
+  return &*it;
+}
+
+// Option crc_policy: whether the CRC of this image data chunk is checked.
+// The sampled chunks are evenly spread, the first one is always checked.
+
+bool Analysis::crcSampled() {
+  switch(options.crc_policy) {
+  case CRC_FULL     : return true;
+  case CRC_METADATA : return false;
+  default :
+    crc_sample_credit += options.crc_sample;
+    if(crc_sample_credit < 100) return false;
+    crc_sample_credit -= 100;
+    return true;
+  }
+}
+
+// Option header_only
+
+unsigned Analysis::headerField(uint32_t id) {
+  switch(id) {
+  case fourcc(HEADER)       : return FIELD_IHDR;
+  case fourcc(EMBEDDED_ICC) : return FIELD_ICCP;
+  case fourcc(SRGB)         : return FIELD_SRGB;
+  case fourcc(GAMMA)        : return FIELD_GAMA;
+  default                   : return 0;
+  }
+}
+
+// end of the report when the analysis stopped before the image data
+
+int Analysis::endHeaderOnly() {
+  static const char *names[] = {HEADER, EMBEDDED_ICC, SRGB, GAMMA};
+  if(!options.text_only) {
+    out << "- Header only: stopped " << (fields_found == options.header_only ?
+                                         "once the chunks wanted were found" : "at the image data")
+        << ", after " << input->pos << " bytes\n";
+    std::string found, absent;
+    for(int i=0; i<4; i++) {
+      if(!(options.header_only & (1u << i))) continue;
+      std::string &s = fields_found & (1u << i) ? found : absent;
+      if(!s.empty()) s += ", ";
+      s += names[i];
+    }
+    if(!found.empty()) out << "  Found: " << found << "\n";
+    if(!absent.empty()) out << "  Not present: " << absent << "\n";
+    out << "\n";
+  }
+  out << "Analysis stopped.\n\n";
+  if(error_count > 0) {
+    out << error_count << " non-fatal error" << (error_count>1 ? "s" : "") << " detected.\n";
+  }
+  out << "(Rest of the file not read.)\n";
+  return 0;
+}
+
+// a chunk not wanted: its content is neither checked nor decoded
+// (a memory mapped file is not even touched)
+
+void Analysis::skipChunk() {
+  if(chunk_length < 0) throw erreur_neg;
+  if(!options.text_only) {
+    out << "- Chunk " << chunk_name << " (size = " << chunk_length << " bytes), skipped\n\n";
+  }
+  chunk_start = input->pos;
+  PhaseTimer::Scope t(timer,PhaseTimer::READ,(int64_t)chunk_length+4);
+  input->skip((size_t)chunk_length+4);
+  chunk_next = input->pos;
+}
+
+/*
+ * Analysis of the file
+ */
+
+int Analysis::run(Input &in) {
+
+  input = &in;
+  size_t size;
+  input_in_memory = in.contents(size) != nullptr;
+  signature_ok = false;
+
+  // start the analysis
+
+  total_idat_chunks = 0;
+  total_idat_bytes = 0;
+  bad_crc_count = 0;
+  unchecked_crc_count = 0;
+  known_crc_count = 0;
+  crc_sample_credit = 99;
+  total_text_chunks = 0;
+  error_count = 0;
+  image_data_started = false;
+  image_data_done = false;
+  expected_data_bytes = -1;
+  stopped = false;
+  fields_found = 0;
+
+  bool output=!options.text_only;
+
+  try {
+    
+    // Read signature
+    
+    const int sig_size=8; // 8
+    unsigned char sig[sig_size] = {137,80,78,71,13,10,26,10};
+
+    {
+      PhaseTimer::Scope t(timer,PhaseTimer::SIGNATURE,sig_size);
+      readSignature(sig_size);
+    }
+    
+    if(output) { out << "- Signature (first 8 bytes) :"; }
+    
+    if(output) {
+      for(int i=0; i<sig_size; i++) {
+        out  << " " << (int) signature[i];
+      }
+      out << "\n"; 
+    } 
+    signature_ok = strncmp((char *) signature,(char *) sig, sig_size)==0;
+    if(signature_ok) {
+      if(output) { out << "  correct" << "\n\n"; }
+    }
+    else {
+      return fatalError("\nFatal Error: wrong signature\n" 
+                        "(should be = h89 h50 h4E h47 h0D h0A h1A h0A in hex,\n" 
+                        "meaning 137 80 78 71 13 10 26 10 in decimal)\n",SIGN_ERROR);
+    };
+    
+    // initialise order flags
+    
+    first_chunk=true;
+    header_met=false;
+    palette_met=false;
+    data_met=false;
+    data_ended=false;
+    data_error=false;
+    end_met=false;
+    background_met=false;
+    gamma_met=false;
+    chroma_met=false;
+    histogram_met=false;
+    pixel_met=false;
+    transparency_met=false;
+    bits_met=false;
+
+    // main loop
+    
+    end_chunk_met=false;
+    bool file_end=false;
+    do {
+      chunkRead(); // handle next chunk
+      file_end = input->atEnd();
+    } while(!end_chunk_met && !file_end && !stopped);
+
+    if(stopped) return endHeaderOnly();
+
+    if(options.inflate && total_idat_chunks && !image_data_done) {
+      endImageData();
+    }
+
+    if(!end_chunk_met) {
+      error() << "Error: no END chunk\n";
+    }
+    else {
+      if(!file_end) {
+        error() << "Error: data beyond chunk END (" << input->remaining() << " bytes)\n";
+      }
+    }
+    
+    if(!options.text_only) {
+      if(options.hide_IDAT) out << "- ";
+      out << "Image data: " << total_idat_bytes << " bytes in " << total_idat_chunks << " IDAT chunks\n\n"; 
+    }
+
+    if(options.text_only && total_text_chunks==0) {
+      out << "Found no text chunk\n\n";
+    }
+
+    if(bad_crc_count) out << "Found " << bad_crc_count << " chunks with bad crc checksum\n\n"; 
+    if(unchecked_crc_count) out << "CRC not checked on " << unchecked_crc_count << " IDAT chunks\n\n";
+    if(known_crc_count) out << "CRC known from a previous analysis on " << known_crc_count << " chunks\n\n";
+
+    out << "Analysis finished.\n\n";
+    
+    if(error_count >0) {
+      out << error_count << " non-fatal error" << (error_count>1 ? "s" : "") << " detected.\n";
+    } else {
+      out << "File looks OK.\n";
+    }
+    if(options.inflate) {
+      out << "(Image data decompressed and checked, no image decoding attempted.)\n";
+    }
+    else {
+      out << "(No image decoding attempted.)\n";
+    }
+  }
+  catch(erreur_eof_struct err) {
+    return fatalError("Fatal Error: unexpected end of file\n",EOF_ERROR);
+  }
+  catch(erreur_read_struct err) {
+    return fatalError("Fatal Error: file read error\n",READ_ERROR);
+  }
+  catch(std::bad_alloc &err) {
+    return fatalError("Fatal Error : memory error\n",MEM_ERROR);
+  }
+  catch(erreur_neg_struct err) {
+    return fatalError("Fatal Error: negative length chunk\n",NEG_ERROR);
+  }
+  catch (std::ios_base::failure &e) {
+    return fatalError("Fatal Error : exception opening/reading/closing file\n",FILE_ERROR);
+  }
+
+  return 0;
+}
+
+// Library entry points
+
+bool pngan_init(const char *crc_engine, const char *filter_engine) {
+  bool crc_ok = init_crc(crc_engine);
+  bool filter_ok = init_filters(filter_engine);
+  init_text();
+  return crc_ok && filter_ok;
+}
+
+void pngan_set_jobs(unsigned n) {
+  jobs = n;
+}
+
+PngResult pngan_analyse(Input &input, PngVisitor &visitor, const PngOptions &options,
+                        std::ostream *report) {
+  std::ostream null_report(nullptr); // discards everything
+  Analysis a(report ? *report : null_report,visitor,options);
+  PngResult r;
+  a.timer.on = options.timings;
+  {
+    PhaseTimer::Scope t(a.timer,PhaseTimer::OTHER); // what is not in the other phases
+    r.fatal_error = a.run(input);
+  }
+  r.stopped_early = a.stopped;
+  r.fields_found = a.fields_found;
+  r.signature_ok = a.signature_ok;
+  r.error_count = a.error_count;
+  r.bad_crc_count = a.bad_crc_count;
+  r.unchecked_crc_count = a.unchecked_crc_count;
+  r.known_crc_count = a.known_crc_count;
+  r.total_idat_chunks = a.total_idat_chunks;
+  r.total_idat_bytes = a.total_idat_bytes;
+  r.total_text_chunks = a.total_text_chunks;
+  r.data_checked = a.image_data_done;
+  r.data_bytes = a.image_data.out_bytes;
+  r.expected_data_bytes = a.expected_data_bytes;
+  r.rows_checked = a.row_decoder.active;
+  r.rows = a.row_decoder.rows;
+  for(int i=0; i<5; i++) r.filter_counts[i] = a.row_decoder.filter_counts[i];
+  r.invalid_filters = a.row_decoder.invalid_filters;
+  if(a.row_decoder.passes.size() > 1) {
+    for(const RowDecoder::Pass &p : a.row_decoder.passes) {
+      PngPass pass;
+      pass.width = (int32_t) p.width;
+      pass.height = (int32_t) p.height;
+      pass.rows = p.rows;
+      pass.bytes = p.rows*p.row_size;
+      for(int i=0; i<5; i++) pass.filter_counts[i] = p.filter_counts[i];
+      r.passes.push_back(pass);
+    }
+  }
+  if(a.options.profile && a.image_data_done) {
+    if(a.image_data.zlib_header_len == 2) {
+      int cmf = a.image_data.zlib_header[0];
+      r.zlib_window = (cmf & 15) == 8 && (cmf >> 4) <= 7 ? 1 << ((cmf >> 4)+8) : 0;
+      r.zlib_level = a.image_data.zlib_header[1] >> 6;
+    }
+    for(const StreamProfile::Band &b : a.profile.bands) {
+      PngBand band;
+      band.first_row = b.first_row;
+      band.rows = b.rows;
+      band.raw_bytes = b.raw_bytes;
+      band.compressed_bytes = b.compressed_bytes;
+      for(int i=0; i<5; i++) band.filter_counts[i] = b.filter_counts[i];
+      band.invalid_filters = b.filter_counts[5];
+      r.bands.push_back(band);
+    }
+  }
+  if(a.options.timings) {
+    static const char *names[] = {"other","signature","chunk header","read","crc","order","inflate"};
+    for(size_t i=0; i<a.timer.phases.size(); i++) {
+      const PhaseTimer::Phase &p = a.timer.phases[i];
+      if(!p.calls) continue;
+      PngPhase phase;
+      if(i < PhaseTimer::HANDLERS) phase.name = names[i];
+      else if(i-PhaseTimer::HANDLERS < (size_t) chunk_types_count) {
+        uint32_t id = chunk_types[i-PhaseTimer::HANDLERS].id;
+        phase.name = "handler ";
+        for(int k=3; k>=0; k--) phase.name += (char)(id >> (8*k));
+      }
+      else phase.name = "handler (unknown chunks)";
+      phase.nanoseconds = p.ns;
+      phase.bytes = p.bytes;
+      phase.calls = p.calls;
+      r.phases.push_back(phase);
+    }
+  }
+  return r;
+}
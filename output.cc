@@ -0,0 +1,112 @@
+// Output of the reports
+//
+// The report of a file is written into a ReportStream: a std::ostream whose
+// buffer is one large block of memory, so that the many small insertions of
+// the handlers are plain copies. Each thread keeps its buffers from file to
+// file (ThreadReport). A finished report goes to the standard output in one
+// write, under a lock (writeOut): the reports of concurrent analyses are
+// never mixed. A single report may also be written as it grows (spill).
+
+#include <climits>
+
+std::mutex output_m;
+
+void writeOut(const char *data, size_t size) {
+  std::lock_guard<std::mutex> lk(output_m);
+  std::cout.write(data,size);
+  std::cout.flush();
+}
+
+class ReportBuffer : public std::streambuf {
+  static const size_t INITIAL = 1 << 16;  // 64 KB
+  static const size_t KEPT = 1 << 22;     // a bigger buffer is not kept for the next report
+  static const size_t SPILL = 1 << 20;    // written out by blocks of 1 MB (option spill)
+  std::vector<char> buffer;
+  bool spill;
+
+  void advance(size_t n) {
+    for(; n > INT_MAX; n -= INT_MAX) pbump(INT_MAX);
+    pbump((int) n);
+  }
+
+  // room for n more bytes
+  void reserve(size_t n) {
+    size_t used = size();
+    if(spill && used+n > SPILL) {
+      writeOut(pbase(),used);
+      used = 0;
+    }
+    if(used+n > buffer.size()) buffer.resize(std::max(buffer.size()*2,used+n));
+    setp(buffer.data(),buffer.data()+buffer.size());
+    advance(used);
+  }
+
+protected:
+  int_type overflow(int_type c) {
+    reserve(1);
+    if(!traits_type::eq_int_type(c,traits_type::eof())) {
+      *pptr() = traits_type::to_char_type(c);
+      pbump(1);
+    }
+    return traits_type::not_eof(c);
+  }
+
+  std::streamsize xsputn(const char *s, std::streamsize n) {
+    if(epptr()-pptr() < n) reserve((size_t) n);
+    memcpy(pptr(),s,(size_t) n);
+    advance((size_t) n);
+    return n;
+  }
+
+public:
+  ReportBuffer() : buffer(INITIAL), spill(false) { reset(false); }
+
+  const char *data() const { return pbase(); }
+  size_t size() const { return pptr()-pbase(); }
+
+  // empties the buffer for the next report; with spill, the report is written
+  // to the standard output whenever the buffer is full
+  void reset(bool spill_out) {
+    spill = spill_out;
+    if(buffer.size() > KEPT) std::vector<char>(INITIAL).swap(buffer);
+    setp(buffer.data(),buffer.data()+buffer.size());
+  }
+};
+
+class ReportStream : public std::ostream {
+  ReportBuffer b;
+public:
+  ReportStream() : std::ostream(nullptr) { rdbuf(&b); }
+
+  const char *data() const { return b.data(); }
+  size_t size() const { return b.size(); }
+  void reset(bool spill = false) { b.reset(spill); clear(); }
+  void writeOut() { ::writeOut(b.data(),b.size()); b.reset(false); }
+};
+
+// A report buffer of the current thread, given back at the end. A thread
+// waiting in the thread pool may start the analysis of another file: it
+// then gets another buffer.
+
+class ThreadReport {
+  std::unique_ptr<ReportStream> s;
+
+  static std::vector<std::unique_ptr<ReportStream>> &spare() {
+    static thread_local std::vector<std::unique_ptr<ReportStream>> streams;
+    return streams;
+  }
+
+public:
+  explicit ThreadReport(bool spill = false) {
+    if(spare().empty()) s.reset(new ReportStream);
+    else {
+      s = std::move(spare().back());
+      spare().pop_back();
+    }
+    s->reset(spill);
+  }
+  ~ThreadReport() { spare().push_back(std::move(s)); }
+
+  ReportStream &operator*() { return *s; }
+  ReportStream *operator->() { return s.get(); }
+};
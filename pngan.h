@@ -0,0 +1,225 @@
+// PNGan library
+//
+// Analyses the structure of a PNG file: chunks, CRCs, chunk ordering rules
+// and the content of the chunks known by the program.
+// The analysis reads its bytes from an Input and reports what it finds
+// - to a PngVisitor, as structured data
+// - optionally, as the human readable report of the PNGan program
+// It never writes to the console and never terminates the program.
+//
+// Usage:
+//   pngan_init();                                  // once
+//   std::unique_ptr<Input> in = openInput("a.png");
+//   PngVisitor v;                                  // or a derived class
+//   PngResult r = pngan_analyse(*in,v,PngOptions());
+//
+// Compilation of the library :
+// > g++ -c -O2 libpngan.cc && ar rcs libpngan.a libpngan.o
+// programs using it are linked with -lpngan -lz -pthread
+
+#ifndef PNGAN_H
+#define PNGAN_H
+
+#include "constants.cc"
+
+#include <cstdint> // bad, used for int*_t and uint*_t
+#include <cstddef>
+#include <ios>
+#include <ostream>
+#include <string>
+#include <memory>
+#include <vector>
+
+// Errors met while reading (thrown by Input::read)
+
+struct erreur_eof_struct {};
+struct erreur_read_struct {};
+struct erreur_neg_struct {};
+extern erreur_eof_struct  erreur_eof;
+extern erreur_read_struct erreur_read;
+extern erreur_neg_struct  erreur_neg;
+
+// Byte source of the analysis (the implementations are in input.cc)
+// The analysis only reads forward.
+
+class Input {
+public:
+  std::streamoff pos;   // number of bytes read so far (we never seek back)
+
+  Input() : pos(0) {}
+  virtual ~Input() {}
+
+  // returns a view on the next n bytes and moves forward
+  // the view is only valid until the next call
+  // throws an exception of the analysis if they cannot be read
+  virtual const unsigned char* read(size_t n) = 0;
+  // whether all the bytes have been read
+  virtual bool atEnd() = 0;
+  // number of bytes not read yet (the stream version consumes them)
+  virtual std::streamoff remaining() = 0;
+  // moves forward n bytes without looking at them
+  virtual void skip(size_t n) { read(n); }
+  // all the bytes, if they are in memory (memory mapped file), nullptr otherwise
+  virtual const unsigned char* contents(size_t &/*size*/) { return nullptr; }
+};
+
+// opens the file, memory mapped if possible, returns nullptr on failure
+std::unique_ptr<Input> openInput(const char *filename);
+
+// bytes read from a stream (pipe, standard input...), strictly forward
+std::unique_ptr<Input> streamInput(std::istream &in);
+
+// the next "size" bytes of another input (a file inside an archive), which
+// must not be read directly while this one is used
+std::unique_ptr<Input> boundedInput(Input &in, std::streamoff size);
+
+// bytes already in memory (they are not copied and must stay valid during the analysis)
+std::unique_ptr<Input> memoryInput(const unsigned char *data, size_t size);
+
+// What the analysis finds
+
+struct PngChunk {
+  char           name[5];  // null terminated
+  std::streamoff offset;   // position of the chunk content in the file
+  int32_t        length;
+  uint32_t       crc;      // as stored in the file
+  uint32_t       computed_crc; // if checked
+  bool           crc_checked; // false if skipped (see PngOptions::crc_policy)
+  bool           crc_ok;   // true if not checked
+};
+
+struct PngHeader {
+  int32_t        width, height;
+  unsigned char  bit_depth, color_type, compression, filter, interlace;
+};
+
+struct PngText {
+  const char    *chunk;    // tEXt, zTXt or iTXt
+  std::string    keyword;  // utf-8
+  std::string    language; // iTXt only
+  std::string    translated_keyword; // iTXt only, utf-8
+  std::string    text;     // utf-8, only if decoded (see PngOptions::no_text)
+  bool           decoded;
+};
+
+// Receives what the analysis finds, in the order of the file
+// (the default implementation ignores everything)
+
+class PngVisitor {
+public:
+  virtual ~PngVisitor() {}
+  virtual void on_chunk(const PngChunk &/*chunk*/) {}
+  virtual void on_header(const PngHeader &/*header*/) {}
+  virtual void on_text(const PngText &/*text*/) {}
+  // message as written in the report; fatal errors stop the analysis
+  virtual void on_error(const std::string &/*message*/, bool /*fatal*/) {}
+};
+
+// Fields of the header-only mode (PngOptions::header_only): chunks that can
+// only appear before the image data
+const unsigned FIELD_IHDR = 1, FIELD_ICCP = 2, FIELD_SRGB = 4, FIELD_GAMA = 8;
+const unsigned FIELDS_ALL = FIELD_IHDR | FIELD_ICCP | FIELD_SRGB | FIELD_GAMA;
+
+// Which CRCs are checked (PngOptions::crc_policy)
+enum CrcPolicy {
+  CRC_FULL,      // all the chunks
+  CRC_METADATA,  // all but IDAT: without option inflate, the image data is not even read
+  CRC_SAMPLED    // all but IDAT, and a sample of the IDAT chunks (crc_sample %)
+};
+
+struct PngOptions {
+  bool           text_only;  // report: only the text chunks
+  bool           no_text;    // do not decode the text chunks
+  bool           hide_IDAT;  // report: nothing on each image data chunk
+  bool           inflate;    // decompress the image data and check it (not decoded)
+  bool           unfilter;   // also rebuild the rows and check their filter types (needs inflate)
+  bool           profile;    // also the zlib header and the compression of the rows by band (needs unfilter)
+  std::ostream  *icc;        // where to dump the ICC profile (nullptr: not dumped)
+  unsigned       header_only; // 0, or the fields wanted (FIELD_*): only these chunks are analysed
+                              // and the analysis stops when they are all found, or at the first IDAT
+  CrcPolicy      crc_policy;
+  int            crc_sample;  // CRC_SAMPLED: percentage of the IDAT chunks checked, evenly spread
+  // chunks found by a previous analysis of the same unchanged file, sorted by offset:
+  // their CRC is not computed again, and their content not read if not needed
+  const std::vector<PngChunk> *known_chunks;
+  bool           timings;     // measure the time and bytes of each phase (PngResult::phases)
+
+  PngOptions() : text_only(false), no_text(false), hide_IDAT(false), inflate(false), unfilter(false),
+                 profile(false), icc(nullptr), header_only(0), crc_policy(CRC_FULL), crc_sample(100),
+                 known_chunks(nullptr), timings(false) {}
+};
+
+// Adam7 pass of an interlaced image (option unfilter)
+struct PngPass {
+  int32_t        width, height;    // in pixels
+  std::streamoff rows;             // rows received
+  std::streamoff bytes;            // decompressed bytes, filter type bytes included
+  std::streamoff filter_counts[5];
+};
+
+// Band of consecutive rows of the image data (option profile)
+struct PngBand {
+  std::streamoff first_row, rows;  // in the order of the data (all passes)
+  std::streamoff raw_bytes;        // decompressed bytes, filter type bytes included
+  std::streamoff compressed_bytes; // zlib input consumed for these rows (approximately)
+  std::streamoff filter_counts[5];
+  std::streamoff invalid_filters;
+};
+
+// Phase of the analysis (option timings)
+struct PngPhase {
+  std::string    name;        // signature, chunk header, read, crc, order, inflate,
+                              // handler XXXX (by chunk type), other (the rest of the analysis)
+  int64_t        nanoseconds; // wall time, without the phases nested in it
+  std::streamoff bytes;       // bytes processed
+  std::streamoff calls;
+};
+
+struct PngResult {
+  int            fatal_error;  // 0 or the code of the fatal error (see constants.cc)
+  bool           signature_ok; // the file starts with the PNG signature
+  long int       error_count;  // non-fatal errors
+  std::streamoff bad_crc_count;
+  std::streamoff unchecked_crc_count; // chunks whose CRC was skipped (crc_policy)
+  std::streamoff known_crc_count;     // chunks whose CRC was known (known_chunks)
+  std::streamoff total_idat_chunks;
+  std::streamoff total_idat_bytes;
+  std::streamoff total_text_chunks;
+  bool           data_checked;        // image data decompressed (option inflate)
+  std::streamoff data_bytes;          // size of the decompressed image data
+  std::streamoff expected_data_bytes; // as implied by the header, -1 if unknown
+  bool           rows_checked;        // rows rebuilt (option unfilter)
+  std::streamoff rows;
+  std::streamoff filter_counts[5];    // rows by filter type (None, Sub, Up, Average, Paeth)
+  std::streamoff invalid_filters;     // rows with an invalid filter type
+  std::vector<PngPass> passes;        // the 7 Adam7 passes if the image is interlaced
+  int            zlib_window;         // option profile: from the zlib header, 0 if unknown
+  int            zlib_level;          // option profile: 0 (fastest) to 3 (maximum), -1 if unknown
+  std::vector<PngBand> bands;         // option profile
+  bool           stopped_early;       // option header_only: the rest of the file was not read
+  unsigned       fields_found;        // option header_only: FIELD_* of the chunks met
+  std::vector<PngPhase> phases;       // option timings, the phases met (in a fixed order)
+
+  PngResult() : fatal_error(0), signature_ok(false), error_count(0), bad_crc_count(0), unchecked_crc_count(0), known_crc_count(0),
+                total_idat_chunks(0), total_idat_bytes(0), total_text_chunks(0),
+                data_checked(false), data_bytes(0), expected_data_bytes(-1),
+                rows_checked(false), rows(0), invalid_filters(0), zlib_window(0), zlib_level(-1),
+                stopped_early(false), fields_found(0) {
+    for(int i=0; i<5; i++) filter_counts[i] = 0;
+  }
+};
+
+// builds the CRC tables and selects the CRC and row filter engines: the ones given
+// by name, or by default the fastest available ones; returns false if an engine
+// is not available
+bool pngan_init(const char *crc_engine = nullptr, const char *filter_engine = nullptr);
+
+// number of threads used by the library (0 = number of processors),
+// to be set before the first analysis
+void pngan_set_jobs(unsigned n);
+
+// analyses a PNG file, writing the human readable report to "report" if not null
+PngResult pngan_analyse(Input &input, PngVisitor &visitor, const PngOptions &options,
+                        std::ostream *report = nullptr);
+
+#endif
@@ -0,0 +1,128 @@
+// Files to analyse
+//
+// The names of the files to analyse go through a FileQueue: they may be
+// known in advance (command line, list on the standard input) or be found
+// while walking directory trees (option -r). The directories are read by
+// tasks on the thread pool, so that the files found are analysed while
+// the walk goes on.
+
+#ifndef _WIN32
+#include <dirent.h>
+#include <sys/stat.h>
+#endif
+
+struct FileEntry {
+  std::string name;
+  bool        found;  // found in a directory: analysed only if it is a PNG file
+};
+
+class FileQueue {
+  std::mutex m;
+  std::condition_variable cv;
+  std::deque<FileEntry> entries;
+  long producers;     // number of directories being read (+1 while filling)
+
+public:
+  ThreadPool::Group group;  // the directory tasks
+  std::atomic<long> errors; // directories that could not be read
+
+  FileQueue() : producers(1), errors(0) {}
+
+  void push(const std::string &name, bool found) {
+    FileEntry e;
+    e.name = name;
+    e.found = found;
+    std::lock_guard<std::mutex> lk(m);
+    entries.push_back(std::move(e));
+    cv.notify_one();
+  }
+
+  void addProducer() {
+    std::lock_guard<std::mutex> lk(m);
+    producers++;
+  }
+
+  void removeProducer() {
+    std::lock_guard<std::mutex> lk(m);
+    producers--;
+    cv.notify_all();
+  }
+
+  // gets the next file, returns false when there will be no more files
+  // while waiting, the current thread runs tasks of the pool
+  bool pop(FileEntry &e, ThreadPool &p) {
+    for(;;) {
+      {
+        std::unique_lock<std::mutex> lk(m);
+        if(!entries.empty()) {
+          e = std::move(entries.front());
+          entries.pop_front();
+          return true;
+        }
+        if(producers == 0) return false;
+      }
+      if(!p.runOne()) {
+        std::unique_lock<std::mutex> lk(m);
+        cv.wait_for(lk,std::chrono::milliseconds(10),[this]{ return !entries.empty() || producers == 0; });
+      }
+    }
+  }
+};
+
+bool isDirectory(const std::string &name) {
+#ifndef _WIN32
+  struct stat st;
+  return stat(name.c_str(),&st) == 0 && S_ISDIR(st.st_mode);
+#else
+  return false;
+#endif
+}
+
+// reads a directory: its files are pushed in the queue and its sub-directories
+// are read by new tasks (symbolic links to directories are not followed)
+
+void scanDirectory(const std::string &dir, FileQueue &queue, ThreadPool &p) {
+#ifndef _WIN32
+  DIR *d = opendir(dir.c_str());
+  if(!d) {
+    std::cerr << "Error : unable to read directory " << dir << "\n";
+    queue.errors++;
+    return;
+  }
+  std::string prefix = dir.back()=='/' ? dir : dir+"/";
+  while(struct dirent *entry = readdir(d)) {
+    if(strcmp(entry->d_name,".")==0 || strcmp(entry->d_name,"..")==0) continue;
+    std::string name = prefix+entry->d_name;
+    bool is_dir = false, is_file = false;
+#ifdef DT_DIR
+    is_dir = entry->d_type == DT_DIR;
+    is_file = entry->d_type == DT_REG;
+    if(entry->d_type == DT_LNK || entry->d_type == DT_UNKNOWN)
+#endif
+    {
+      struct stat st;
+      if(lstat(name.c_str(),&st) == 0) {
+        is_dir = S_ISDIR(st.st_mode);
+        is_file = S_ISREG(st.st_mode);
+        if(S_ISLNK(st.st_mode) && stat(name.c_str(),&st) == 0) {
+          is_file = S_ISREG(st.st_mode);
+        }
+      }
+    }
+    if(is_dir) {
+      queue.addProducer();
+      p.submit(queue.group,[name,&queue,&p]() {
+        scanDirectory(name,queue,p);
+        queue.removeProducer();
+      });
+    }
+    else if(is_file) {
+      queue.push(name,true);
+    }
+  }
+  closedir(d);
+#else
+  std::cerr << "Error : directory " << dir << " not analysed, option -r is not available on this system\n";
+  queue.errors++;
+#endif
+}
@@ -0,0 +1,135 @@
+// Files inside tar archives (option --tar)
+//
+// The archive is read once, forward only: memory mapped, or as a stream
+// (the standard input with -). Each regular file of the archive is analysed
+// in place through a view bounded to its content (boundedInput), the files
+// that are not PNG files are skipped silently. The reports are named
+// "archive:path".
+//
+// Formats: ustar, with the pax extended headers (path, size) and the GNU
+// long names; the archive must not be compressed.
+
+class TarReader {
+  Input &in;
+  std::string pax_path, long_name; // for the next entry
+  uint64_t pax_size;
+  bool has_pax_size;
+
+  // numeric field: octal, or base-256 if the first bit is set (big sizes)
+  static uint64_t number(const unsigned char *p, size_t len) {
+    uint64_t v = 0;
+    if(p[0] & 0x80) {
+      v = p[0] & 0x7f;
+      for(size_t i=1; i<len; i++) v = (v << 8) | p[i];
+      return v;
+    }
+    for(size_t i=0; i<len && p[i]; i++) {
+      if(p[i] >= '0' && p[i] <= '7') v = (v << 3) | (p[i]-'0');
+    }
+    return v;
+  }
+
+  static std::string field(const unsigned char *p, size_t len) {
+    size_t n = 0;
+    while(n < len && p[n]) n++;
+    return std::string((const char *) p,n);
+  }
+
+  // the checksum is computed with its own field taken as spaces
+  static bool checksumOk(const unsigned char *h) {
+    uint64_t sum = 0;
+    for(int i=0; i<512; i++) sum += (i >= 148 && i < 156) ? ' ' : h[i];
+    return sum == number(h+148,8);
+  }
+
+  // pax records: "length key=value\n"
+  void readPax(const std::string &data) {
+    size_t p = 0;
+    while(p < data.size()) {
+      size_t space = data.find(' ',p);
+      if(space == std::string::npos) return;
+      size_t len = (size_t) strtoul(data.c_str()+p,nullptr,10);
+      if(len == 0 || p+len > data.size()) return;
+      std::string record = data.substr(space+1,p+len-space-2); // without the '\n'
+      size_t eq = record.find('=');
+      if(eq != std::string::npos) {
+        std::string key = record.substr(0,eq), value = record.substr(eq+1);
+        if(key == "path") pax_path = value;
+        else if(key == "size") {
+          pax_size = strtoull(value.c_str(),nullptr,10);
+          has_pax_size = true;
+        }
+      }
+      p += len;
+    }
+  }
+
+  static uint64_t padded(uint64_t size) { return (size+511) & ~(uint64_t)511; }
+
+public:
+  std::string error; // why the walk stopped, empty at the end of the archive
+
+  explicit TarReader(Input &input) : in(input), pax_size(0), has_pax_size(false) {}
+
+  // finds the next regular file, returns false at the end of the archive or on error
+  // its content is then the next "size" bytes of the input
+  bool next(std::string &name, uint64_t &size) {
+    try {
+      for(;;) {
+        if(in.atEnd()) return false; // no end blocks
+        std::streamoff offset = in.pos;
+        const unsigned char *h = in.read(512);
+        bool zero = true;
+        for(int i=0; i<512 && zero; i++) zero = h[i] == 0;
+        if(zero) return false;
+        if(!checksumOk(h)) {
+          error = "invalid tar header at offset " + std::to_string(offset);
+          return false;
+        }
+        char type = (char) h[156];
+        size = number(h+124,12);
+        name = field(h,100);
+        if(memcmp(h+257,"ustar",5) == 0 && h[345]) name = field(h+345,155) + "/" + name;
+
+        if(type == 'x' || type == 'L') { // applies to the next entry
+          std::string data((const char *) in.read((size_t)size),(size_t)size);
+          in.skip((size_t)(padded(size)-size));
+          if(type == 'x') readPax(data);
+          else long_name = field((const unsigned char *) data.data(),data.size());
+          continue;
+        }
+        if(!pax_path.empty()) name = pax_path;
+        else if(!long_name.empty()) name = long_name;
+        if(has_pax_size) size = pax_size;
+        pax_path.clear();
+        long_name.clear();
+        has_pax_size = false;
+
+        if(type == '0' || type == 0 || type == '7') return true;
+        in.skip((size_t)padded(size)); // directories, links, global headers...
+      }
+    }
+    catch(erreur_eof_struct err) {
+      error = "unexpected end of the archive";
+    }
+    catch(erreur_read_struct err) {
+      error = "read error";
+    }
+    return false;
+  }
+
+  // moves to the next header, "end" being the end of the content of the file
+  bool skipTo(std::streamoff end) {
+    try {
+      in.skip((size_t)(padded(end)-in.pos));
+      return true;
+    }
+    catch(erreur_eof_struct err) {
+      error = "unexpected end of the archive";
+    }
+    catch(erreur_read_struct err) {
+      error = "read error";
+    }
+    return false;
+  }
+};
@@ -0,0 +1,281 @@
+// Text encodings of the text chunks
+//
+// tEXt and zTXt are latin-1 encoded, the report and the results are in
+// utf-8: latin1_to_utf8() appends the utf-8 form of a latin-1 text to a
+// string. Its size is at most twice the size of the text, so the string is
+// sized once and written directly. Most texts are mostly ASCII, copied as is:
+// the runs of ASCII bytes are copied by blocks, after checking the high bit
+// of all the bytes of a block at once.
+//
+// iTXt is utf-8 encoded: Utf8Validator checks it as it comes (the morsels
+// of the decompression), with the same ASCII fast path and a DFA for the
+// other bytes, and gives the offset of the first invalid sequence.
+//
+// Engines of the ASCII fast path:
+// - scalar : 8 bytes at a time in an integer
+// - sse2   : 16 bytes
+// - avx2   : 32 bytes
+// - neon   : 16 bytes (ARM 64 bits)
+// The fastest engine supported by the CPU is chosen at run time by init_text(),
+// after checking it gives the same results as the scalar one (the CPU
+// features are those of filter.cc).
+
+// copies the ASCII bytes at the beginning of src, up to len, returns their number
+typedef size_t (*ascii_copy_function)(unsigned char *dst, const unsigned char *src, size_t len);
+// the same without copying them
+typedef size_t (*ascii_scan_function)(const unsigned char *src, size_t len);
+
+size_t ascii_scan_scalar(const unsigned char *src, size_t len) {
+  size_t i = 0;
+  for( ; i+8<=len; i+=8) {
+    uint64_t v;
+    memcpy(&v,src+i,8);
+    if(v & 0x8080808080808080ULL) break;
+  }
+  for( ; i<len && src[i] < 0x80; i++) {}
+  return i;
+}
+
+size_t ascii_copy_scalar(unsigned char *dst, const unsigned char *src, size_t len) {
+  size_t i = 0;
+  for( ; i+8<=len; i+=8) {
+    uint64_t v;
+    memcpy(&v,src+i,8);
+    if(v & 0x8080808080808080ULL) break;
+    memcpy(dst+i,&v,8);
+  }
+  for( ; i<len && src[i] < 0x80; i++) dst[i] = src[i];
+  return i;
+}
+
+#ifdef FILTER_X86
+
+__attribute__((target("sse2")))
+size_t ascii_copy_sse2(unsigned char *dst, const unsigned char *src, size_t len) {
+  size_t i = 0;
+  for( ; i+16<=len; i+=16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(src+i));
+    if(_mm_movemask_epi8(v)) break;
+    _mm_storeu_si128((__m128i *)(dst+i),v);
+  }
+  return i+ascii_copy_scalar(dst+i,src+i,len-i);
+}
+
+__attribute__((target("sse2")))
+size_t ascii_scan_sse2(const unsigned char *src, size_t len) {
+  size_t i = 0;
+  for( ; i+16<=len; i+=16) {
+    int mask = _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(src+i)));
+    if(mask) return i+__builtin_ctz(mask);
+  }
+  return i+ascii_scan_scalar(src+i,len-i);
+}
+
+__attribute__((target("avx2")))
+size_t ascii_scan_avx2(const unsigned char *src, size_t len) {
+  size_t i = 0;
+  for( ; i+32<=len; i+=32) {
+    unsigned mask = (unsigned) _mm256_movemask_epi8(_mm256_loadu_si256((const __m256i *)(src+i)));
+    if(mask) return i+__builtin_ctz(mask);
+  }
+  return i+ascii_scan_sse2(src+i,len-i);
+}
+
+__attribute__((target("avx2")))
+size_t ascii_copy_avx2(unsigned char *dst, const unsigned char *src, size_t len) {
+  size_t i = 0;
+  for( ; i+32<=len; i+=32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(src+i));
+    if(_mm256_movemask_epi8(v)) break;
+    _mm256_storeu_si256((__m256i *)(dst+i),v);
+  }
+  return i+ascii_copy_sse2(dst+i,src+i,len-i);
+}
+
+#endif
+
+#if defined(FILTER_NEON) && defined(__aarch64__)
+#define TEXT_NEON
+
+size_t ascii_copy_neon(unsigned char *dst, const unsigned char *src, size_t len) {
+  size_t i = 0;
+  for( ; i+16<=len; i+=16) {
+    uint8x16_t v = vld1q_u8(src+i);
+    if(vmaxvq_u8(v) >= 0x80) break;
+    vst1q_u8(dst+i,v);
+  }
+  return i+ascii_copy_scalar(dst+i,src+i,len-i);
+}
+
+size_t ascii_scan_neon(const unsigned char *src, size_t len) {
+  size_t i = 0;
+  for( ; i+16<=len && vmaxvq_u8(vld1q_u8(src+i)) < 0x80; i+=16) {}
+  return i+ascii_scan_scalar(src+i,len-i);
+}
+
+#endif
+
+struct TextEngine {
+  const char          *name;
+  ascii_copy_function  ascii_copy;
+  ascii_scan_function  ascii_scan;
+  bool                 available;
+};
+
+TextEngine text_engines[] = {
+  { "scalar", ascii_copy_scalar, ascii_scan_scalar, true },
+#ifdef FILTER_X86
+  { "sse2",   ascii_copy_sse2,   ascii_scan_sse2,   false }, // depends on the CPU
+  { "avx2",   ascii_copy_avx2,   ascii_scan_avx2,   false },
+#endif
+#ifdef TEXT_NEON
+  { "neon",   ascii_copy_neon,   ascii_scan_neon,   true },
+#endif
+};
+const int text_engine_count = sizeof(text_engines)/sizeof(text_engines[0]);
+
+ascii_copy_function ascii_copy = ascii_copy_scalar;
+ascii_scan_function ascii_scan = ascii_scan_scalar;
+
+// appends the utf-8 encoding of the latin-1 text "in" (len bytes) to out
+
+void latin1_to_utf8(const unsigned char *in, size_t len, std::string &out) {
+  if(len == 0) return;
+  size_t start = out.size();
+  out.resize(start+2*len);
+  unsigned char *d = (unsigned char *) &out[start];
+  size_t i = 0;
+  while(i < len) {
+    size_t n = ascii_copy(d,in+i,len-i);
+    d += n;
+    i += n;
+    for( ; i<len && in[i] >= 0x80; i++) {
+      *d++ = (unsigned char)(0xc0 | in[i] >> 6);
+      *d++ = (unsigned char)(0x80 | (in[i] & 0x3f));
+    }
+  }
+  out.resize(d-(unsigned char *) &out[0]);
+}
+
+std::string latin1_to_utf8(const unsigned char *in, size_t len) {
+  std::string out;
+  latin1_to_utf8(in,len,out);
+  return out;
+}
+
+// Validation of utf-8 given by pieces
+//
+// The DFA follows the table of the well-formed sequences of the Unicode
+// standard (3.9, table 3-7): no overlong form, no surrogate, nothing beyond
+// U+10FFFF. Its input is the class of the byte.
+//
+//   Utf8Validator v;
+//   v.feed(p,n); v.feed(q,m); ...
+//   if(!v.finish()) ... v.error_offset ...
+
+class Utf8Validator {
+  enum { ACCEPT, TAIL1, TAIL2, TAIL3, AFTER_E0, AFTER_ED, AFTER_F0, AFTER_F4, REJECT };
+
+  struct Tables {
+    unsigned char byte_class[256];
+    unsigned char next[REJECT][12];  // by state and class
+
+    Tables() {
+      // classes: 0 00..7F, 1 80..8F, 2 90..9F, 3 A0..BF, 4 invalid (C0, C1, F5..FF),
+      // 5 C2..DF, 6 E0, 7 E1..EC and EE..EF, 8 ED, 9 F0, 10 F1..F3, 11 F4
+      for(int c=0; c<256; c++) {
+        byte_class[c] = c < 0x80 ? 0 : c < 0x90 ? 1 : c < 0xa0 ? 2 : c < 0xc0 ? 3 : c < 0xc2 ? 4
+                      : c < 0xe0 ? 5 : c == 0xe0 ? 6 : c == 0xed ? 8 : c < 0xf0 ? 7 : c == 0xf0 ? 9
+                      : c < 0xf4 ? 10 : c == 0xf4 ? 11 : 4;
+      }
+      memset(next,REJECT,sizeof(next));
+      static const unsigned char lead[12] = {ACCEPT,REJECT,REJECT,REJECT,REJECT,TAIL1,
+                                             AFTER_E0,TAIL2,AFTER_ED,AFTER_F0,TAIL3,AFTER_F4};
+      memcpy(next[ACCEPT],lead,12);
+      for(int k=1; k<=3; k++) {
+        next[TAIL1][k] = ACCEPT;
+        next[TAIL2][k] = TAIL1;
+        next[TAIL3][k] = TAIL2;
+      }
+      next[AFTER_E0][3] = TAIL1;                           // A0..BF
+      next[AFTER_ED][1] = next[AFTER_ED][2] = TAIL1;       // 80..9F
+      next[AFTER_F0][2] = next[AFTER_F0][3] = TAIL2;       // 90..BF
+      next[AFTER_F4][1] = TAIL2;                           // 80..8F
+    }
+  };
+
+  static const Tables &tables() {
+    static const Tables t;
+    return t;
+  }
+
+  int state;
+  uint64_t sequence_start;     // offset of the first byte of the current sequence
+
+public:
+  uint64_t bytes;              // bytes given so far
+  int64_t  error_offset;       // offset of the first invalid sequence, -1 if none
+
+  Utf8Validator() : state(ACCEPT), sequence_start(0), bytes(0), error_offset(-1) {}
+
+  // checks the next len bytes (nothing more once an error is found)
+  void feed(const unsigned char *p, size_t len) {
+    const Tables &t = tables();
+    size_t i = 0;
+    while(i < len && error_offset < 0) {
+      if(state == ACCEPT) {
+        i += ascii_scan(p+i,len-i);
+        if(i == len) break;
+        sequence_start = bytes+i;
+      }
+      state = t.next[state][t.byte_class[p[i]]];
+      if(state == REJECT) {
+        // a byte that cannot start a sequence, or the one that breaks it
+        error_offset = (int64_t) sequence_start;
+        break;
+      }
+      i++;
+    }
+    bytes += len;
+  }
+
+  // true if all the bytes given are valid utf-8 (a sequence must not be cut at the end)
+  bool finish() {
+    if(error_offset < 0 && state != ACCEPT) error_offset = (int64_t) sequence_start;
+    return error_offset < 0;
+  }
+};
+
+// compares an engine with the scalar one on texts with some non-ASCII bytes
+// at all the positions of a block
+
+bool text_self_test(ascii_copy_function f, ascii_scan_function g) {
+  unsigned char src[100], dst[100], expected[100];
+  for(size_t len=0; len<=100; len+=11) {
+    for(size_t high=0; high<=len; high++) { // high = len: only ASCII
+      for(size_t i=0; i<len; i++) src[i] = (unsigned char)(32+(i*7)%90);
+      if(high < len) src[high] = (unsigned char)(0x80+high);
+      size_t n = ascii_copy_scalar(expected,src,len);
+      if(f(dst,src,len) != n || memcmp(dst,expected,n) != 0 || g(src,len) != n) return false;
+    }
+  }
+  return true;
+}
+
+// selects the last (fastest) available engine
+
+void init_text() {
+#ifdef FILTER_X86
+  text_engines[1].available = filter_sse2_supported();
+  text_engines[2].available = filter_sse2_supported() && filter_avx2_supported();
+#endif
+  for(int i=0; i<text_engine_count; i++) {
+    TextEngine &e = text_engines[i];
+    if(!e.available || !text_self_test(e.ascii_copy,e.ascii_scan)) {
+      e.available = false;
+      continue;
+    }
+    ascii_copy = e.ascii_copy;
+    ascii_scan = e.ascii_scan;
+  }
+}
@@ -0,0 +1,141 @@
+// Thread pool with work stealing
+//
+// Each worker owns a queue: it takes its own tasks from the back (last in,
+// first out, good for the cache) and, when it has nothing left, steals the
+// oldest tasks at the front of the other queues.
+// A thread waiting for a group of tasks helps executing them instead of
+// blocking, so tasks may themselves submit and wait for tasks; it only
+// sleeps when there is nothing to take.
+
+#ifndef THREADS_H
+#define THREADS_H
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <deque>
+#include <vector>
+#include <memory>
+
+class ThreadPool {
+  struct Queue {
+    std::mutex m;
+    std::deque<std::function<void()>> tasks;
+  };
+  std::vector<std::unique_ptr<Queue>> queues; // one per worker, plus one for outside threads
+  std::vector<std::thread> threads;
+  std::mutex sleep_m;
+  std::condition_variable sleep_cv;
+  std::atomic<long> pending;  // number of queued tasks
+  std::atomic<unsigned> next; // round robin for submissions from outside threads
+  bool stop;
+
+  static int &self() { // index of the queue of the current thread
+    static thread_local int index = -1;
+    return index;
+  }
+
+  bool take(int q, bool back, std::function<void()> &task) {
+    Queue &queue = *queues[q];
+    std::lock_guard<std::mutex> lk(queue.m);
+    if(queue.tasks.empty()) return false;
+    if(back) {
+      task = std::move(queue.tasks.back());
+      queue.tasks.pop_back();
+    }
+    else {
+      task = std::move(queue.tasks.front());
+      queue.tasks.pop_front();
+    }
+    pending--;
+    return true;
+  }
+
+  void work(int index) {
+    self() = index;
+    for(;;) {
+      if(runOne()) continue;
+      std::unique_lock<std::mutex> lk(sleep_m);
+      sleep_cv.wait(lk,[this]{ return stop || pending > 0; });
+      if(stop && pending == 0) return;
+    }
+  }
+
+public:
+  // a group of tasks that can be waited for
+  struct Group {
+    std::atomic<long> count;
+    Group() : count(0) {}
+  };
+
+  // n: number of threads, including the thread that submits and waits
+  explicit ThreadPool(unsigned n) : pending(0), next(0), stop(false) {
+    if(n < 1) n = 1;
+    for(unsigned i=0; i<n; i++) queues.emplace_back(new Queue);
+    for(unsigned i=0; i+1<n; i++) threads.emplace_back(&ThreadPool::work,this,(int)i);
+  }
+
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> lk(sleep_m);
+      stop = true;
+    }
+    sleep_cv.notify_all();
+    for(auto &t : threads) t.join();
+  }
+
+  unsigned size() const { return (unsigned)queues.size(); }
+
+  void submit(Group &group, std::function<void()> f) {
+    group.count++;
+    Group *g = &group;
+    std::function<void()> task = [this,g,f]() {
+      f();
+      if(--g->count == 0) {
+        { std::lock_guard<std::mutex> lk(sleep_m); } // no wake up lost
+        sleep_cv.notify_all(); // the threads waiting for the group
+      }
+    };
+    int q = self();
+    if(q < 0) q = next++ % queues.size();
+    {
+      std::lock_guard<std::mutex> lk(queues[q]->m);
+      queues[q]->tasks.push_back(std::move(task));
+    }
+    pending++;
+    { std::lock_guard<std::mutex> lk(sleep_m); } // no wake up lost
+    sleep_cv.notify_one();
+  }
+
+  // runs one task: one of ours if any, else a stolen one
+  bool runOne() {
+    std::function<void()> task;
+    int q = self();
+    bool found = q >= 0 && take(q,true,task);
+    for(size_t i=0; !found && i<queues.size(); i++) {
+      found = take((q+1+i) % queues.size(),false,task);
+    }
+    if(!found) return false;
+    task();
+    return true;
+  }
+
+  // waits until all tasks of the group are finished, helping meanwhile;
+  // sleeps when its last tasks are running on other threads
+  void wait(Group &group) {
+    while(group.count > 0) {
+      if(runOne()) continue;
+      std::unique_lock<std::mutex> lk(sleep_m);
+      sleep_cv.wait(lk,[this,&group]{ return group.count == 0 || pending > 0; });
+    }
+  }
+};
+
+// the pool shared by the whole program (libpngan.cc), created on first use
+// with "jobs" threads (0 = number of processors)
+extern unsigned jobs;
+ThreadPool &getPool();
+
+#endif
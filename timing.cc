@@ -0,0 +1,58 @@
+// Time and bytes of each phase of the analysis (option timings)
+//
+// A phase is measured by a Scope object living while it runs. The scopes
+// nest (the decompression of a zTXt chunk inside its handler, the CRC of a
+// chunk inside its reading): the time of a phase does not include the
+// phases nested in it, so that the times of all the phases add up to the
+// time of the analysis. Without the option a scope costs a test, the clock
+// is not read.
+
+#include <chrono>
+
+class PhaseTimer {
+public:
+  // the handler of chunk_types[i] is the phase HANDLERS+i, the unknown chunks come after them
+  enum { OTHER, SIGNATURE, CHUNK_HEADER, READ, CRC, ORDER, INFLATE, HANDLERS };
+
+  struct Phase {
+    int64_t ns, bytes, calls;
+    Phase() : ns(0), bytes(0), calls(0) {}
+  };
+
+  typedef std::chrono::steady_clock Clock;
+
+  class Scope {
+    PhaseTimer &t;
+    size_t id;
+    Scope *parent;
+    int64_t nested;          // time of the scopes nested in this one
+    Clock::time_point start;
+
+  public:
+    Scope(PhaseTimer &timer, size_t phase, int64_t bytes = 0)
+      : t(timer), id(phase), parent(nullptr), nested(0) {
+      if(!t.on) return;
+      if(id >= t.phases.size()) t.phases.resize(id+1);
+      t.phases[id].bytes += bytes;
+      t.phases[id].calls++;
+      parent = t.current;
+      t.current = this;
+      start = Clock::now();
+    }
+    ~Scope() {
+      if(!t.on) return;
+      int64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now()-start).count();
+      t.phases[id].ns += ns-nested;
+      if(parent) parent->nested += ns;
+      t.current = parent;
+    }
+  };
+
+  bool on;
+  std::vector<Phase> phases;  // by phase number
+
+  PhaseTimer() : on(false), current(nullptr) {}
+
+private:
+  Scope *current;             // innermost scope
+};